@@ -0,0 +1,120 @@
+/**
+ * Check the bit-vector edit distance kernels against a plain Levenshtein DP on random windows.
+ * Build from the repository root:
+ *   g++ -std=c++11 -O2 -Iinclude ctest/bit_vector_test.cpp src/bit_vector.cpp -o bit_vector_test
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include "bit_vector.h"
+
+/** Edit distance of query[1..q_len] against text[1..t_len], first row 0,1,2,... like Realignment */
+static int levenshtein(const uint8_t *query, int q_len, const uint8_t *text, int t_len) {
+    std::vector<std::vector<int>> H(q_len + 1, std::vector<int>(t_len + 1));
+    for (int j = 0; j <= t_len; j++) H[0][j] = j;
+    for (int i = 0; i <= q_len; i++) H[i][0] = i;
+    for (int i = 1; i <= q_len; i++) {
+        for (int j = 1; j <= t_len; j++) {
+            H[i][j] = std::min(std::min(H[i-1][j], H[i][j-1]) + 1, H[i-1][j-1] + (query[i] == text[j] ? 0 : 1));
+        }
+    }
+    return H[q_len][t_len];
+}
+
+/** Random 1-based sequence; text bases mostly copy the query so distances stay small */
+static void random_window(int q_len, int t_len, std::vector<uint8_t> &query, std::vector<uint8_t> &text) {
+    query.assign(q_len + 1, 0); text.assign(t_len + 2, 0);
+    for (int i = 1; i <= q_len; i++) query[i] = rand() % BV_Task::ALPHABET_SIZE;
+    for (int j = 1; j <= t_len; j++) {
+        text[j] = q_len > 0 and rand() % 3 ? query[std::min(j, q_len)] : rand() % BV_Task::ALPHABET_SIZE;
+    }
+}
+
+template <typename Word>
+static void build_peq(const std::vector<uint8_t> &query, int q_len, Word *peq) {
+    for (int a = 0; a < BV_Task::ALPHABET_SIZE; a++) {
+        peq[a] = 0;
+        for (int i = q_len; i >= 1; i--) peq[a] = (peq[a] << 1) | (query[i] == a);
+    }
+}
+
+/** Batched kernels, every kernel the CPU supports */
+static int test_batch() {
+    int bad = 0;
+    for (int it = 0; it < 2000; it++) {
+        const int n = rand() % 70;
+        std::vector<BV_Task> tasks(n);
+        std::vector<std::vector<uint8_t>> queries(n), texts(n);
+        for (int k = 0; k < n; k++) {
+            const int q_len = rand() % 10 ? rand() % 33 : 0;
+            random_window(q_len, rand() % 40, queries[k], texts[k]);
+            build_peq(queries[k], q_len, tasks[k].peq);
+            tasks[k].text = texts[k].data(); tasks[k].q_len = q_len; tasks[k].t_len = texts[k].size() - 2;
+        }
+        for (int kernel = BV_SCALAR; kernel <= bit_vector_kernel(); kernel++) {
+            std::vector<int> scores(n);
+            bit_vector_batch(tasks.data(), n, scores.data(), (BV_Kernel)kernel);
+            for (int k = 0; k < n; k++) {
+                bad += scores[k] != levenshtein(queries[k].data(), tasks[k].q_len, texts[k].data(), tasks[k].t_len);
+            }
+        }
+    }
+    return bad;
+}
+
+/** Fused REF/ALT kernel: the second text differs from the first at one column */
+static int test_fork() {
+    int bad = 0;
+    std::vector<uint8_t> query, ref, alt;
+    for (int it = 0; it < 100000; it++) {
+        const int q_len = rand() % 33, t_len = rand() % 36;
+        random_window(q_len, t_len, query, ref);
+        alt = ref;
+        const int col = t_len ? 1 + rand() % t_len : 1;
+        if (t_len) alt[col] = rand() % BV_Task::ALPHABET_SIZE;
+
+        BV_Task task;
+        build_peq(query, q_len, task.peq);
+        task.text = ref.data(); task.q_len = q_len; task.t_len = t_len;
+        auto d = bit_vector_fork(task, alt.data(), col);
+        bad += d.first != levenshtein(query.data(), q_len, ref.data(), t_len)
+            or d.second != levenshtein(query.data(), q_len, alt.data(), t_len);
+    }
+    return bad;
+}
+
+/**
+ * Fork kernels for windows wider than 32 bases: one 64-bit word up to 64 query bases,
+ * chained 64-bit blocks beyond (-w above 31)
+ */
+static int test_wide_fork() {
+    int bad = 0;
+    std::vector<uint8_t> query, ref, alt;
+    for (int it = 0; it < 20000; it++) {
+        const int q_len = 1 + rand() % 200, t_len = std::max(0, q_len + rand() % 21 - 10);
+        random_window(q_len, t_len, query, ref);
+        alt = ref;
+        const int col = t_len ? 1 + rand() % t_len : 1;
+        if (t_len) alt[col] = rand() % BV_Task::ALPHABET_SIZE;
+
+        // peq[a * words + w] holds query rows [64w, 64w + 64)
+        const int words = (q_len + 63) / 64;
+        std::vector<uint64_t> peq(BV_Task::ALPHABET_SIZE * words, 0);
+        for (int i = 1; i <= q_len; i++) peq[query[i] * words + (i - 1) / 64] |= 1ull << ((i - 1) % 64);
+
+        const auto expect = std::make_pair(levenshtein(query.data(), q_len, ref.data(), t_len),
+                                           levenshtein(query.data(), q_len, alt.data(), t_len));
+        if (q_len <= 64) bad += bit_vector_fork<uint64_t>(peq.data(), q_len, ref.data(), alt.data(), t_len, col) != expect;
+        bad += bit_vector_fork_blocked(peq.data(), words, q_len, ref.data(), alt.data(), t_len, col) != expect;
+    }
+    return bad;
+}
+
+int main() {
+    srand(7);
+    const int batch = test_batch(), fork = test_fork(), wide = test_wide_fork();
+    printf("kernel %d: %d batch, %d fork and %d wide fork mismatches\n", bit_vector_kernel(), batch, fork, wide);
+    return batch + fork + wide > 0;
+}
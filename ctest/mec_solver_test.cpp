@@ -0,0 +1,136 @@
+/**
+ * Check MEC_Solver against an exhaustive search over all haplotypes on random small fragment matrices,
+ * and that HPTree never reports a score below the optimum. Low coverage limits make the solver drop
+ * reads and reuse bits, the search then runs over the reads the greedy downsampling keeps.
+ * Build from the repository root:
+ *   g++ -std=c++11 -O2 -Iinclude ctest/mec_solver_test.cpp src/mec_solver.cpp src/hptree.cpp src/fragment.cpp -o mec_solver_test
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include "fragment.h"
+#include "mec_solver.h"
+#include "hptree.h"
+
+/** Called alleles of one read, kept aside for the exhaustive search */
+struct Test_Read {
+    int rid; /** Row in the fragment matrix */
+    std::vector<int> snp, allele, weight;
+};
+
+/**
+ * Weighted MEC of haplotype 1 over [beg, end), allele of SNP i is hap(i).
+ * Reads with less than two alleles in the range are left out like in MEC_Solver.
+ */
+template <typename Hap>
+static long mec(const std::vector<Test_Read> &reads, int beg, int end, Hap hap) {
+    long total = 0;
+    for (const auto &read : reads) {
+        long c0 = 0, c1 = 0;
+        int calls = 0;
+        for (int k = 0; k < read.snp.size(); k++) {
+            const int s = read.snp[k];
+            if (s < beg or s >= end) continue;
+            calls++;
+            const int h = hap(s);
+            if (h < 0) continue;
+            if (read.allele[k] != h) c0 += read.weight[k]; else c1 += read.weight[k];
+        }
+        if (calls >= 2) total += std::min(c0, c1);
+    }
+    return total;
+}
+
+/**
+ * Reads MEC_Solver keeps in [beg, end) at @param max_coverage: reads with at least two alleles
+ * in the range, most alleles first, then by first SNP and row, while no SNP of their span is full.
+ */
+static std::vector<Test_Read> kept_reads(const std::vector<Test_Read> &reads, int beg, int end, int max_coverage) {
+    struct Span { int calls, first, last, n; };
+    std::vector<Span> spans;
+    for (int n = 0; n < reads.size(); n++) {
+        Span span{0, -1, -1, n};
+        for (int s : reads[n].snp) {
+            if (s < beg or s >= end) continue;
+            if (span.first < 0) span.first = s;
+            span.last = s; span.calls++;
+        }
+        if (span.calls >= 2) spans.push_back(span);
+    }
+    std::sort(spans.begin(), spans.end(), [&](const Span &a, const Span &b) {
+        return a.calls != b.calls ? a.calls > b.calls : a.first != b.first ? a.first < b.first : reads[a.n].rid < reads[b.n].rid;
+    });
+
+    std::vector<int> cov(end - beg, 0);
+    std::vector<Test_Read> kept;
+    for (const auto &span : spans) {
+        if (*std::max_element(cov.begin() + (span.first - beg), cov.begin() + (span.last - beg) + 1) >= max_coverage) continue;
+        for (int s = span.first; s <= span.last; s++) cov[s - beg]++;
+        kept.push_back(reads[span.n]);
+    }
+    return kept;
+}
+
+int main() {
+    srand(7);
+    int bad = 0, tree_bad = 0, cut_bad = 0;
+    for (int it = 0; it < 2000; it++) {
+        const int snp_n = 3 + rand() % 10, read_n = 1 + rand() % 12;
+        Fragment_Matrix frags;
+        std::vector<Test_Read> reads;
+        for (int r = 0; r < read_n; r++) {
+            const int first = rand() % snp_n, last = first + rand() % (snp_n - first);
+            Read_Allele calls;
+            Test_Read read;
+            read.rid = reads.size();
+            for (int s = first; s <= last; s++) {
+                if (rand() % 4 == 0) continue;
+                const int allele = rand() % 5 == 0 ? -1 : rand() % 2, weight = 1 + rand() % 30;
+                calls.emplace_back(0, s, allele, weight);
+                if (allele < 0) continue;
+                read.snp.push_back(s); read.allele.push_back(allele); read.weight.push_back(weight);
+            }
+            if (calls.empty()) continue;
+            frags.add_row(calls);
+            reads.push_back(read);
+        }
+        frags.transpose(snp_n);
+
+        const int beg = rand() % snp_n, end = beg + 1 + rand() % (snp_n - beg);
+        HPTree tree(frags);
+        std::vector<int8_t> tree_hap;
+        const long tree_score = tree.phase(beg, end, tree_hap);
+        for (int max_coverage : {MEC_Solver::MAX_COVERAGE, 1, 2, 3, 4}) {
+            MEC_Solver solver(frags, max_coverage);
+            std::vector<int8_t> hap;
+            std::vector<int> cuts;
+            const long score = solver.phase(beg, end, hap, cuts);
+            const auto kept = kept_reads(reads, beg, end, max_coverage);
+
+            long best = -1;
+            for (int mask = 0; mask < 1 << (end - beg); mask++) {
+                long v = mec(kept, beg, end, [&](int s) { return mask >> (s - beg) & 1; });
+                if (best < 0 or v < best) best = v;
+            }
+            const long got = mec(kept, beg, end, [&](int s) { return (int)hap[s - beg]; });
+            bad += best != score or got != score;
+            if (max_coverage == MEC_Solver::MAX_COVERAGE) tree_bad += tree_score < best;
+
+            // No kept read may have alleles on both sides of a cut
+            for (int cut : cuts) {
+                for (const auto &read : kept) {
+                    bool left = false, right = false;
+                    for (int s : read.snp) {
+                        if (s >= beg and s < cut) left = true;
+                        if (s >= cut and s < end) right = true;
+                    }
+                    cut_bad += left and right;
+                }
+            }
+        }
+    }
+    printf("%d MEC mismatches, %d tree scores below the optimum, %d reads across cuts\n", bad, tree_bad, cut_bad);
+    return bad + tree_bad + cut_bad > 0;
+}
@@ -8,7 +8,7 @@ int main(int argc, char **argv) {
     // gzFile f = gzopen(fn, "r");
 
     auto table = input_vcf(fn, nullptr);
-    auto fasta = FASTA_Reader(fa);
+    FASTA_Reader fasta(fa);
 
 
 
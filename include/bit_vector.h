@@ -0,0 +1,66 @@
+#ifndef BIT_VECTOR_H
+#define BIT_VECTOR_H
+
+#include <cstdint>
+#include <utility>
+
+/**
+ * One global alignment task for Myers' bit-vector algorithm.
+ * The query (at most 32 bases) is encoded column-wise in peq, the text is
+ * scanned base by base. The first DP row is 0,1,2,... like Realignment.
+ */
+struct BV_Task {
+	static const int ALPHABET_SIZE = 5; /** A, C, G, T and other. */
+	uint32_t peq[ALPHABET_SIZE]; /** Bit i of peq[a] is set iff query[i+1] == a */
+	const uint8_t *text; /** Encoded text, 1-based index */
+	int q_len, t_len;
+};
+
+enum BV_Kernel {
+	BV_SCALAR = 0,
+	BV_AVX2   = 1, /** 8 tasks per 256-bit vector */
+	BV_AVX512 = 2, /** 16 tasks per 512-bit vector */
+};
+
+/** Widest kernel supported by the running CPU */
+BV_Kernel bit_vector_kernel();
+
+/** Number of tasks a kernel solves per vector */
+int bit_vector_lanes(BV_Kernel kernel);
+
+/**
+ * Edit distances of independent tasks, packing one task per 32-bit lane.
+ * All kernels produce identical scores; leftovers of a batch run on the scalar path.
+ * @param scores output, scores[i] is the edit distance of tasks[i]
+ */
+void bit_vector_batch(const BV_Task *tasks, int n, int *scores, BV_Kernel kernel = bit_vector_kernel());
+
+/** Edit distance of a single task */
+int bit_vector_scalar(const BV_Task &task);
+
+/**
+ * Edit distances of the query against task.text and an alternative text that
+ * differs only at column @param col (1-based). Columns before the fork are
+ * computed once, so a REF/ALT pair costs about 1.5 instead of 2 passes.
+ * @return pair of edit distance with task.text and @param alt
+ */
+std::pair<int, int> bit_vector_fork(const BV_Task &task, const uint8_t *alt, int col);
+
+/**
+ * Single-word version of the fork kernel for a query of up to 32 (Word = uint32_t)
+ * or 64 (Word = uint64_t) bases; both widths are instantiated in bit_vector.cpp.
+ * @param peq  ALPHABET_SIZE match vectors of the query
+ * @param ref and @param alt texts of length @param t_len (1-based) differing only at column @param col
+ */
+template <typename Word>
+std::pair<int, int> bit_vector_fork(const Word *peq, int q_len, const uint8_t *ref, const uint8_t *alt,
+                                    int t_len, int col);
+
+/**
+ * Blocked (multi-word) fork kernel for queries longer than 64 bases.
+ * @param peq  ALPHABET_SIZE groups of @param words 64-bit words, peq[a * words + w] holds rows [64w, 64w+64)
+ */
+std::pair<int, int> bit_vector_fork_blocked(const uint64_t *peq, int words, int q_len, const uint8_t *ref,
+                                            const uint8_t *alt, int t_len, int col);
+
+#endif
@@ -7,6 +7,14 @@
 #include <map>
 #include <zlib.h>
 #include <cstring>
+#include <cstdint>
+#include <mutex>
+
+#include "sam.h"
+#include "faidx.h"
+#include "thread_pool.h"
+#include "packed_contig.h"
+#include "fragment.h"
 
 const int VCF_CHROM  = 0;
 const int VCF_POS    = 1;
@@ -36,54 +44,100 @@ public:
 
 };
 
-struct SNP {
-    int pos;
-    char ref; // 该位点在ref上对应base
-    char alt; // vcf对应base
-    char *line;
-
-    // 记录覆盖该SNP的read以及read上该位点的base与ref/alt一样，或者没有。
-    std::vector<int> rid; /** Read indices on this SNP */ // 因为read会被存储下来
-    std::vector<int> allele; /** Alleles of reads. 0:REF 1:ALT -1:gap */
+/**
+ * SNVs of one chromosome in structure-of-arrays layout, one array per field,
+ * so that searches and sweeps over positions only touch pos.
+ * Reads covering each SNP are found in the transposed view of the Fragment_Matrix.
+ */
+struct SNP_Column {
+    std::vector<int> pos;
+    std::vector<char> ref; // 该位点在ref上对应base
+    std::vector<char> alt; // vcf对应base
+    std::vector<uint64_t> line_off; /** Offset of the VCF line in Variant_Table::lines */
 
     /** Phased result */
-    int ps;
-    int gt; /** GT=0 for 0|1; GT=1 for 1|0; GT=-1 for unknown */
-
-    SNP(int p, char r, char a, const char* l): pos(p), ref(r), alt(a) {
-        ps = -1;
-        gt = -1;
-        if(l) line = strdup(l);
-        else line = nullptr;
-    }
+    std::vector<int> ps;
+    std::vector<int8_t> gt; /** GT=0 for 0|1; GT=1 for 1|0; GT=-1 for unknown */
 
-    inline void add_read(int r, int a) {
-        rid.push_back(r);
-        allele.push_back(a);
-    }
+    inline int size() const { return (int)pos.size(); }
+    inline bool empty() const { return pos.empty(); }
 
-    inline int size() const { return (int)rid.size(); }
-    
-    bool operator < (const SNP &o) const { return this->pos < o.pos; }
+    void push_back(int p, char r, char a, uint64_t off);
+
+    /** Sort every array by position, keeping the input order of equal positions */
+    void sort();
 };
 
 struct Variant_Table {
     int size;
     VCF_Header header;
     std::vector<std::string> chromosomes;
-    std::vector<std::vector<SNP>> variants; // 对应各chr上的SNPs。
+    std::vector<SNP_Column> variants; // 对应各chr上的SNPs。
+    std::vector<char> lines; /** Arena of all VCF records, each terminated by '\0' */
+    std::vector<uint64_t> records; /** Offset of every record in lines, in input order, loaded or not */
+
+    Variant_Table(): size(0) {}
+
+    /** Append a line to the arena, @return its offset */
+    inline uint64_t add_line(const char *l, uint32_t len) {
+        uint64_t off = lines.size();
+        lines.insert(lines.end(), l, l + len);
+        lines.push_back('\0');
+        return off;
+    }
 };
 
-Variant_Table input_vcf(const char *fn, const char *chromosome);
+/**
+ * Load SNVs from a plain, gzip or bgzip compressed VCF file.
+ * @param chromosome only keep variants on this chromosome (nullptr for all)
+ * @param pool       optional htslib thread pool used to inflate bgzip blocks
+ * @param beg and @param end only keep variants with beg <= POS <= end (1-based)
+ */
+Variant_Table input_vcf(const char *fn, const char *chromosome, htsThreadPool *pool = nullptr,
+                        int beg = 1, int end = INT32_MAX);
+
+/**
+ * Write the header and every input record, in input order, to @param fn (stdout for nullptr).
+ * Phased SNVs get GT=0|1 or 1|0 and PS of their phase set, other records
+ * (indels, homozygous or unphased sites, records outside the region) are copied as they were read.
+ */
+void output_vcf(const char *fn, Variant_Table &vt);
 
 std::vector<std::string> split_str(const char *s, char sep);
 
+/** Part of a line located in place, not NUL-terminated */
+struct Field {
+    const char *s;
+    int len;
+
+    Field(): s(nullptr), len(0) {}
+
+    inline bool empty() const { return len == 0; }
+    inline bool equals(const char *t, int n) const { return len == n and memcmp(s, t, n) == 0; }
+    inline std::string str() const { return std::string(s, len); }
+};
+
+/** Columns of a VCF record used for phasing */
+struct VCF_Record {
+    Field chrom, pos, ref, alt;
+    Field gt; /** Genotype of the first sample, empty when FORMAT does not start with GT */
+};
+
+/**
+ * Locate the needed columns of @param line in a single pass, without copying.
+ * @return false if the record has less than 5 columns
+ */
+bool scan_vcf_record(const char *line, VCF_Record &rec);
+
+/** Parse a non-negative decimal integer, @return -1 if @param f is not one */
+int parse_int(const Field &f);
+
 /**************
  *   FASTA    *
  **************/
 struct FAIDX_Contig {
     int length;
-    int offset;
+    long offset; /** Byte offset of the first base, beyond 2^31 on large references */
     int line_bases;
     int line_width;
 
@@ -96,55 +150,116 @@ struct FAIDX_Contig {
     }
 };
 
+/**
+ * Plain FASTA is mapped read-only and contig bases are addressed in place
+ * through the .fai line geometry; bgzip-compressed FASTA (with .fai and .gzi)
+ * goes through htslib's faidx. One reader can be shared by all worker threads.
+ */
 class FASTA_Reader {
 public:
-    gzFile ref_fp;
+    std::string fn;
     std::map<std::string, FAIDX_Contig> dict; /** Dictionary from chromosome to offset */
 
+    const char *map_base; /** Whole plain FASTA file, nullptr for bgzip input */
+    size_t map_size;
+    faidx_t *fai; /** Only for bgzip input */
+    std::mutex fai_lock; /** faidx_t shares one BGZF handle */
+
 public:
     explicit FASTA_Reader(const std::string &fn);
+    ~FASTA_Reader() { close(); }
 
-    inline int get_length(const std::string &chr_name) {
-        return dict.find(chr_name) != dict.end() ? dict[chr_name].length : -1;
+    FASTA_Reader(const FASTA_Reader &) = delete;
+    FASTA_Reader &operator=(const FASTA_Reader &) = delete;
+
+    inline int get_length(const std::string &chr_name) const {
+        auto it = dict.find(chr_name);
+        return it != dict.end() ? it->second.length : -1;
     }
 
+    /** Copy of the whole contig, release with delete [] */
     char *get_contig(const std::string &chr_name);
 
-    inline void close() { gzclose(ref_fp); }
+    /** Contig packed into 2 bits per base, read straight from the mapping when possible */
+    Packed_Contig get_packed_contig(const std::string &chr_name);
+
+    /**
+     * Only bases [beg, end) (0-based, clipped to the contig) packed, located through the line geometry.
+     * Positions in the returned contig are relative to its offset, which is the clipped @param beg.
+     */
+    Packed_Contig get_packed_region(const std::string &chr_name, int beg, int end);
+
+    void close();
 };
 
 
 /**************
  *    BAM     *
  **************/
-struct Allele_Call {
-    /** 
-     * 一个等位基因（附加存在），根据后面的用途：
-     * SNPs会分别按reads和vcf文件进行存储，即记录各read上的SNPs信息 + 保存vcf文件中SNPs的信息
-     * 因此该数据结构作为一个附加的存在，需记录
-     * 1. 其在query read上的位置，也就是read上第几个snp
-     * 2. 在vcf文件SNPs上的位置，同样，也是基于index保存
-     * 3. 该等位基因信息，方便起见， 0表示与REF相同，1表示与read支持的ALT相同，-1表示gap/unknown
-    */
-   int que_pos; //position on query read
-   int snp_idx; //position on vcf snps
-   int allele;
-   Allele_Call(int q, int s, int a): que_pos(q), snp_idx(s), allele(a) {}
+class BAM_Reader {
+public:
+    std::string fn; /** Kept to open more readers on the same file */
+    htsThreadPool *pool; /** Shared BGZF decompression pool, may be nullptr */
+    samFile *bam_fp;
+    bam_hdr_t *bam_header;
+    hts_idx_t *bam_idx; /** Each worker owns a reader, htslib handles are not thread-safe */
+
+public:
+    explicit BAM_Reader(const char *fn, htsThreadPool *pool = nullptr);
+    ~BAM_Reader();
+
+    BAM_Reader(const BAM_Reader &) = delete;
+    BAM_Reader &operator = (const BAM_Reader &) = delete;
+};
+
+
+struct Detect_Options {
+    int threads; /** Realignment threads for one chromosome */
+    bool pipeline; /** Stream reads through reader/worker threads instead of splitting into windows */
+    int overhang; /** Bases taken on each side of a SNP for realignment */
+
+    /** Read filters, checked before any realignment */
+    int min_mapq; /** Minimum mapping quality */
+    uint16_t exclude_flags; /** Reads with any of these flags are skipped */
+    int min_aligned_len; /** Minimum reference span of the alignment */
+    int min_snps; /** Minimum number of SNPs the alignment spans */
+
+    /**
+     * Alleles on bases of at least this quality are taken from the aligned base, without
+     * realignment, when no indel or clip lies within the overhang around the SNP
+     */
+    int fast_min_baseq;
+
+    /**
+     * Weight every call by a base-quality-aware log-likelihood ratio (Allele_Call::qual)
+     * and resolve edit distance ties by the aligned base, instead of unit-weight votes
+     */
+    bool allele_llr;
+
+    static const uint16_t DEFAULT_EXCLUDE_FLAGS = BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY;
+
+    Detect_Options(): threads(1), pipeline(false), overhang(15),
+                      min_mapq(20), exclude_flags(DEFAULT_EXCLUDE_FLAGS), min_aligned_len(0), min_snps(2),
+                      fast_min_baseq(20), allele_llr(false) {}
 };
-typedef std::vector<Allele_Call> Read_Allele; // 以read为单位保存SNP的形式
 
 /**
  * Detect alleles by realignment
  * 这个函数会进行realignment。
- * @param bam_fn aligned reads
+ * @param bam aligned reads, an opened reader (e.g. one per worker thread)
  * @param chr_name chromosome name
  * @param snps variants to phase
- * @param len reference sequence length
- * @param seq reference sequence
- * @return all alleles on informative reads
+ * @param ref reference sequence, 2-bit packed
+ * @return alleles on informative reads, one row per read; the SNP -> read view is built too
+ *
+ * With more than one thread, the chromosome is either split into windows at
+ * group chunk boundaries that are realigned concurrently, or streamed through
+ * a reader -> workers -> collector pipeline; the result does not depend on
+ * the number of threads.
  */
-std::vector<Read_Allele> detect_allele(const char *bam_fn, const std::string &chr_name,
-									   std::vector<SNP> &snps, int len, const char *seq);
+Fragment_Matrix detect_allele(BAM_Reader &bam, const std::string &chr_name,
+                              const SNP_Column &snps, const Packed_Contig &ref,
+                              const Detect_Options &opt = Detect_Options());
 
 #endif
 
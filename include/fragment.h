@@ -0,0 +1,80 @@
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+struct Allele_Call {
+    /** 
+     * 一个等位基因（附加存在），根据后面的用途：
+     * SNPs会分别按reads和vcf文件进行存储，即记录各read上的SNPs信息 + 保存vcf文件中SNPs的信息
+     * 因此该数据结构作为一个附加的存在，需记录
+     * 1. 其在query read上的位置，也就是read上第几个snp
+     * 2. 在vcf文件SNPs上的位置，同样，也是基于index保存
+     * 3. 该等位基因信息，方便起见， 0表示与REF相同，1表示与read支持的ALT相同，-1表示gap/unknown
+     * 4. 该等位基因的权重
+    */
+   int que_pos; //position on query read
+   int snp_idx; //position on vcf snps
+   int8_t allele;
+   /**
+    * Phred-scaled log-likelihood ratio of the called allele over the other one,
+    * 10 * log10(P(read | called) / P(read | other)), capped at MAX_QUAL.
+    * All calls weigh 1 when alleles are scored by edit distance only.
+    */
+   uint8_t qual;
+   static const int MAX_QUAL = 60;
+   Allele_Call(int q, int s, int a, int w = 1): que_pos(q), snp_idx(s), allele(a), qual(w) {}
+};
+typedef std::vector<Allele_Call> Read_Allele; // 以read为单位保存SNP的形式, 只用作单条 read 的临时缓冲
+
+/**
+ * Alleles of all informative reads (fragments) of a chromosome as a sparse
+ * read x SNP matrix in CSR layout: one set of arrays for every entry instead
+ * of a heap vector per read. Row r holds entries [row_beg[r], row_beg[r+1]),
+ * with increasing SNP indices. transpose() builds the SNP -> read (CSC) view.
+ */
+class Fragment_Matrix {
+public:
+    std::vector<uint32_t> row_beg; /** rows() + 1 offsets */
+    std::vector<uint32_t> snp_idx; /** SNP index of each entry */
+    std::vector<int32_t> que_pos; /** Position of the SNP on the read, -1 inside a leading deletion */
+    std::vector<int8_t> allele; /** 0:REF 1:ALT -1:gap */
+    std::vector<uint8_t> qual; /** Phred-scaled weight of each call, see Allele_Call::qual */
+
+    /** Transposed view, reads on SNP i are col_rid[col_beg[i] .. col_beg[i+1]) in read order */
+    std::vector<uint32_t> col_beg; /** SNP number + 1 offsets, empty before transpose() */
+    std::vector<uint32_t> col_rid;
+    std::vector<int8_t> col_allele;
+    std::vector<uint8_t> col_qual;
+
+public:
+    Fragment_Matrix(): row_beg(1, 0) {}
+
+    inline int rows() const { return (int)row_beg.size() - 1; }
+    inline size_t entries() const { return snp_idx.size(); }
+    inline int row_size(int r) const { return row_beg[r+1] - row_beg[r]; }
+
+    void reserve(int row_n, size_t entry_n);
+
+    /** Drop all rows but keep the capacity */
+    void clear();
+
+    /** Append a read as the last row */
+    void add_row(const Read_Allele &real);
+
+    /** Append all rows of @param o after the existing ones */
+    void append(const Fragment_Matrix &o);
+
+    /** Build the SNP -> read view over @param snp_n SNPs, one counting pass plus one fill pass */
+    void transpose(int snp_n);
+
+    /** Number of reads on SNP @param i, available after transpose() */
+    inline int coverage(int i) const { return col_beg[i+1] - col_beg[i]; }
+
+    /** Heap bytes used by both views */
+    size_t memory() const;
+};
+
+#endif
@@ -3,22 +3,48 @@
 
 #include <vector>
 #include "data_reader.h"
+#include "fragment.h"
 
 class Group {
 public:
     static const int MAX_CHUNK_LENGTH = 100000; // chunkL
     static const int MAX_CHUNK_VARIANTS = 100; // chunkV
-    std::vector<SNP> snp_list; // 存储 SNP 的列表
+    int snp_beg; // 第一个 SNP 在染色体 SNP 列表中的下标
+    int snp_end; // 最后一个 SNP 的下标 + 1, 即 [snp_beg, snp_end)
     int start; // 第一个 SNP 的位置
     int end; // 最后一个 SNP 的位置
     int size; // SNP 的数量
 
-
+    Group(const SNP_Column &snps, int beg, int end_idx): snp_beg(beg), snp_end(end_idx),
+        start(snps.pos[beg]), end(snps.pos[end_idx - 1]), size(end_idx - beg) {}
 };
 typedef std::vector<Group> Groups;
 
-// 接收染色体上所有 SNP，返回所有 SNP 的组
-Groups group_snps(const std::vector<SNP> &snps);
+/** Disjoint sets over SNP indices with path compression; the root of a set is its smallest index */
+class Disjoint_Set {
+private:
+    std::vector<int> parent;
 
-#endif
+public:
+    explicit Disjoint_Set(int n);
+
+    int find(int x);
+    void unite(int a, int b);
+};
+
+/**
+ * Phase blocks: SNPs connected through reads that have alleles on both.
+ * Every read unites the SNPs it calls, in one pass over @param frags.
+ * @return block[i], the smallest SNP index of the block holding SNP i
+ *         (i itself for SNPs no read links to another one)
+ */
+std::vector<int> find_phase_blocks(const Fragment_Matrix &frags, int snp_n);
 
+/**
+ * 接收染色体上所有 SNP，返回所有 SNP 的组
+ * A group ends after chunkV SNPs, when the next SNP is chunkL or more bases away from
+ * its first SNP, or when no phase block in @param blocks continues past the boundary.
+ */
+Groups group_snps(const SNP_Column &snps, const std::vector<int> &blocks);
+
+#endif
@@ -1,9 +1,75 @@
 #ifndef HPTREE_H
 #define HPTREE_H
 
+#include <cstdint>
+#include <vector>
+#include "fragment.h"
+
+/**
+ * Haplotype tree over the SNPs of a group.
+ * Each path from the root fixes haplotype 1 on the SNPs seen so far (haplotype 2
+ * is its complement, all SNPs are heterozygous). A path is extended SNP by SNP
+ * with both alleles, scored by the weight of read alleles conflicting with the
+ * haplotype each read fits best (MEC), and only the best MAX_PATH paths survive,
+ * so the work per SNP is bounded by MAX_PATH times the coverage.
+ */
 class HPTree {
 public:
     static const int MAX_PATH = 10;
+
+private:
+    /** Tree nodes live in one pool and refer to their parent by index */
+    struct Node {
+        int parent; /** -1 for the root */
+        int snp; /** SNP index on the chromosome */
+        int8_t hap; /** Allele of haplotype 1 at snp */
+    };
+
+    /** A surviving leaf and the read counters along its path */
+    struct Path {
+        int node;
+        long score; /** Total weight of conflicting alleles, min over the two haplotypes per read */
+    };
+
+    const Fragment_Matrix &frags;
+
+    std::vector<Node> pool;
+    std::vector<Path> paths, next_paths;
+    /**
+     * Conflicts of each active read with haplotype 1 and 2 on every path:
+     * counters[p][2 * slot + h]. Reads take a slot when their first SNP in the group
+     * is reached and free it after their last one.
+     */
+    std::vector<std::vector<int>> counters, next_counters;
+    std::vector<int> slot; /** Slot of each read, -1 when not active */
+    std::vector<int> free_slots;
+    int slot_n;
+
+    /** Last SNP of @param read before @param end, the read retires there */
+    int last_snp_in(int read, int end) const;
+
+public:
+    /** @param frags read alleles of a chromosome, transposed */
+    explicit HPTree(const Fragment_Matrix &frags);
+
+    /**
+     * Phase SNPs [beg, end) of the chromosome.
+     * @param hap output, hap[i - beg] is the allele of haplotype 1 at SNP i (0:REF 1:ALT),
+     *            or -1 when no read allele covers the SNP inside the range
+     * @return MEC score of the best path
+     */
+    long phase(int beg, int end, std::vector<int8_t> &hap);
 };
 
+/**
+ * Vote of the reads linking two phased ranges of SNPs on whether haplotype 1 of the
+ * right range continues haplotype 1 of the left one. Each read adds the smaller of its
+ * weighted agreements with the two ranges, signed by whether it agrees with both or
+ * with one only.
+ * @param l_hap and @param r_hap haplotype 1 of [l_beg, l_end) and [r_beg, r_end), l_hap[i - l_beg] for SNP i
+ * @return > 0 to keep the right range, < 0 to flip it, 0 when no read links the ranges
+ */
+long stitch_vote(const Fragment_Matrix &frags, int l_beg, int l_end, const int8_t *l_hap,
+                 int r_beg, int r_end, const int8_t *r_hap);
+
 #endif
@@ -0,0 +1,54 @@
+#ifndef MEC_SOLVER_H
+#define MEC_SOLVER_H
+
+#include <cstdint>
+#include <vector>
+#include "fragment.h"
+
+/**
+ * Exact weighted minimum error correction over the SNPs of a group, the dynamic
+ * programming of WhatsHap: at every SNP, each bipartition of the reads active there
+ * costs the weight of the alleles conflicting with the better haplotype, plus the best
+ * bipartition of the previous SNP that agrees on the reads both share.
+ * The table has 2^k entries for k active reads, so reads are first down-sampled until
+ * no SNP is spanned by more than max_coverage of them, keeping reads with more alleles.
+ * Exact where HPTree is greedy, but exponential in the coverage.
+ */
+class MEC_Solver {
+public:
+    static const int MAX_COVERAGE = 16; /** Largest max_coverage accepted */
+
+private:
+    /** A down-sampled read with its alleles inside the range */
+    struct Read_Span {
+        uint32_t rid;
+        int first, last; /** First and last SNP with an allele */
+        int calls; /** Number of alleles */
+    };
+
+    const Fragment_Matrix &frags;
+    const int max_coverage;
+
+    std::vector<int> slot; /** Bit of each selected read in the bipartition masks, -1 otherwise */
+    std::vector<int> table; /** Cost of every mask at every phased SNP, one row of 2^k per SNP */
+
+    /** Pick reads of [beg, end) so that at most max_coverage span any SNP */
+    void downsample(int beg, int end, std::vector<Read_Span> &reads);
+
+public:
+    /**
+     * @param frags read alleles of a chromosome, transposed
+     * @param max_coverage reads kept over each SNP, at most MAX_COVERAGE
+     */
+    MEC_Solver(const Fragment_Matrix &frags, int max_coverage);
+
+    /**
+     * Phase SNPs [beg, end) of the chromosome, same output as HPTree::phase.
+     * @param cuts output, phased SNPs that no down-sampled read links to the phased SNPs
+     *             before them, in increasing order; their relative phase is arbitrary
+     * @return weighted MEC of the down-sampled reads
+     */
+    long phase(int beg, int end, std::vector<int8_t> &hap, std::vector<int> &cuts);
+};
+
+#endif
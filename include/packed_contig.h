@@ -0,0 +1,49 @@
+#ifndef PACKED_CONTIG_H
+#define PACKED_CONTIG_H
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+/**
+ * Reference contig packed into 2 bits per base, built once per contig.
+ * A, C, G and T are stored as codes 0-3; bases out of the alphabet (N and
+ * IUPAC codes) are rare, so they are kept as sorted runs in a side channel
+ * and read as code 4, the same as Realignment's ALPHA_TABLE. Case is
+ * ignored, soft-masked (lowercase) bases pack like upper case ones.
+ */
+class Packed_Contig {
+public:
+    typedef std::pair<int, int> Run; /** [begin, end) relative to offset */
+
+    int offset; /** Contig coordinate (0-based) of the first packed base, non-zero for a region */
+    int length; /** Number of packed bases */
+    std::vector<uint64_t> bases; /** 32 bases per word, base i at bits 2*(i%32) of word i/32 */
+    std::vector<Run> n_runs; /** Bases other than ACGT */
+
+public:
+    Packed_Contig(): offset(0), length(0) {}
+
+    /** Pack @param len bases of @param seq (0-based, not NUL-terminated), which start at contig coordinate @param offset */
+    Packed_Contig(const char *seq, int len, int offset = 0);
+
+    /**
+     * Pack bases [beg, end) of a contig whose FASTA text starts at @param text and is laid out
+     * in lines of @param line_bases bases taking @param line_width bytes each, e.g. a mapped file
+     */
+    Packed_Contig(const char *text, int beg, int end, int line_bases, int line_width);
+
+    /** Contig coordinate just past the last packed base */
+    inline int end() const { return offset + length; }
+
+    /**
+     * Alphabet codes of bases [beg, beg+n) into @param codes: A->0, C->1, G->2, T->3, Other->4.
+     * Here and below positions are relative to offset.
+     */
+    void decode(int beg, int n, uint8_t *codes) const;
+
+private:
+    void pack(const char *text, int beg, int end, int line_bases, int line_width);
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Run job(task, worker) for every task in [0, n) on a pool of worker threads.
+ * Tasks are handed out in index order, so put the most expensive ones first.
+ * @param n       number of tasks
+ * @param threads number of workers; worker ids passed to job are in [0, threads)
+ * @param job     callback, must be safe to run concurrently for different tasks
+ */
+void parallel_for(int n, int threads, const std::function<void(int, int)> &job);
+
+/**
+ * Blocking FIFO with a capacity, for producer/consumer pipelines.
+ * push blocks while the queue is full; pop blocks while it is empty.
+ * After close(), pop drains the remaining items and then returns false.
+ */
+template <typename T>
+class Bounded_Queue {
+private:
+    std::mutex mtx;
+    std::condition_variable not_empty, not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+public:
+    explicit Bounded_Queue(size_t cap): capacity(cap), closed(false) {}
+
+    /** @return false if the queue is already closed */
+    bool push(T v) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_full.wait(lock, [this] { return closed or items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(v));
+        not_empty.notify_one();
+        return true;
+    }
+
+    /** @return false once the queue is closed and drained */
+    bool pop(T &v) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_empty.wait(lock, [this] { return closed or not items.empty(); });
+        if (items.empty()) return false;
+        v = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+#endif
@@ -3,26 +3,63 @@
 
 #include <cstdio>
 #include <utility>
+#include <vector>
 #include "sam.h"
+#include "bit_vector.h"
+#include "packed_contig.h"
 
 class Realignment {
 private:
-    int gr_len; /** Total length of global reference sequence */
-	const char *global_ref; /** Global reference sequence */
+	const Packed_Contig &global_ref; /** Global reference sequence, already encoded; a whole contig or a region of it */
 
-	/** Take SNP as center, extract 15bp from read/reference forwardly and backwardly. */
-	static const int OVERHANG_LEN = 15;
-	static const int MATRIX_SIZE = OVERHANG_LEN * 2 + 5;
+	/** Take SNP as center, extract overhang bp from read/reference forwardly and backwardly. */
+	int overhang;
+	int matrix_size; /** overhang * 2 + 5, size of the extracted sequences */
 	int q_len, r_len; /** Length of extracted query and reference sequence */
-	uint8_t que[MATRIX_SIZE]; /** Extracted query sequence (index from 1) */
-	uint8_t ref[MATRIX_SIZE], alt[MATRIX_SIZE]; /** Extracted reference/alternative sequence (1-based index) */
+	int snp_col; /** Column of the SNP in ref/alt, the only column where they differ */
+	std::vector<uint8_t> que; /** Extracted query sequence (index from 1) */
+	std::vector<uint8_t> ref, alt; /** Extracted reference/alternative sequence (1-based index) */
 
 	/** Bit-vector algorithm */
 	static const int ALPHABET_SIZE = 5; /** A, C, G, T and other. */
 	uint8_t ALPHA_TABLE[256]; /** Alphabet table: A->0, C->1, G->2, T->3, Other->4 */
-	uint32_t peq[ALPHABET_SIZE];
+	int words; /** Number of 64-bit words of the query */
+	std::vector<uint64_t> peq; /** peq[a * words + w], rows [64w, 64w+64) */
+	uint32_t peq32[ALPHABET_SIZE]; /** Copy of peq for queries of up to 32 bases */
+
+	/** Sites queued by add_site and solved together by realign_batch */
+	struct Site {
+		int q_len, r_len, snp_col;
+		uint32_t peq[ALPHABET_SIZE]; /** Only for queries of up to 32 bases, which can be packed into lanes */
+		int text; /** Offset of the reference window in site_text, followed by the alternative one */
+		bool solved; /** Wider queries are solved when queued */
+		std::pair<int, int> dist;
+	};
+	std::vector<Site> sites;
+
+	/** The read being realigned, decoded once by load_read and shared by all its sites */
+	uint8_t NT16_TABLE[16]; /** 4-bit BAM base -> alphabet code */
+	int read_len, read_words;
+	std::vector<uint8_t> read_code; /** Alphabet codes of the read (0-based) */
+	std::vector<uint64_t> read_bits; /** read_bits[a * read_words + w]: bit i is set iff read_code[64w+i] == a */
+	std::vector<uint8_t> site_text;
+	std::vector<BV_Task> tasks;
+	std::vector<int> scores;
+
+	/** Fill que/ref/alt and peq for the SNP on the loaded read, shared by single and batched realignment */
+	void extract(int q_snp, int r_snp, char alt_allele);
+
+	/** Edit distances of the extracted query with ref and alt, on the narrowest word that fits */
+	std::pair<int, int> solve() const;
 public:
-    Realignment(int l, const char *r);
+	static const int DEFAULT_OVERHANG = 15; /** Keeps the query within one 32-bit word */
+
+	/**
+	 * @param r global reference sequence, must outlive the realignment
+	 * @param overhang bases extracted on each side of a SNP; up to 15 runs on 32-bit words,
+	 *                 up to 31 on 64-bit words, and longer windows on blocked bit-vectors
+	 */
+	explicit Realignment(const Packed_Contig &r, int overhang = DEFAULT_OVERHANG);
 
 	/**
 	 * Take the input SNP as center, extract a small faction of reference and query sequence.
@@ -34,6 +71,20 @@ public:
 	 */
 	std::pair<int, int> bit_vector_dp(const bam1_t *aln, int q_snp, int r_snp, char alt_allele);
 
+	/** Decode the read once, before queueing its sites with add_site */
+	void load_read(const bam1_t *aln);
+
+	/** Queue a SNP of the loaded read for realign_batch, parameters are the same as bit_vector_dp */
+	void add_site(int q_snp, int r_snp, char alt_allele);
+
+	/**
+	 * Realign all queued sites at once; the REF and ALT alignments of many sites
+	 * are packed into SIMD lanes when the CPU supports it, the remaining sites
+	 * share the DP prefix of REF and ALT (see bit_vector_fork).
+	 * @param dist output, pairs of edit distance with ref and alt allele in the order sites were added
+	 */
+	void realign_batch(std::vector<std::pair<int, int>> &dist);
+
 	/**
 	 * Compute edit distance between extracted query and reference/alternative sequence.
 	 * Run realignment for alternative sequence to remove reference bias.
@@ -1,9 +1,15 @@
 #include <getopt.h>
 #include <cassert>
+#include <memory>
+#include <algorithm>
+#include <map>
 
 #include "data_reader.h"
 #include "realignment.h"
 #include "group.h"
+#include "hptree.h"
+#include "mec_solver.h"
+#include "parallel.h"
 
 static int usage() {
 	fprintf(stderr, "Usage: phase -b <BAM> -r <FASTA> -v <VCF> -o <Output>\n");
@@ -11,18 +17,70 @@ static int usage() {
 	fprintf(stderr, "  -r reference sequence for allele realignment in FASTA format (indexed required)\n");
 	fprintf(stderr, "  -v heterozygous variants to phase in VCF format\n");
 	fprintf(stderr, "  -o output file that phased results are written to (stdout)\n");
-	fprintf(stderr, "  -c specify a chromosome to phase\n");
+	fprintf(stderr, "  -c specify a chromosome or a region chr:beg-end (1-based, inclusive) to phase;\n");
+	fprintf(stderr, "     only the reference around the region is loaded\n");
+	fprintf(stderr, "  -t number of threads, chromosomes are phased in parallel and split into windows\n");
+	fprintf(stderr, "     when there are more threads than chromosomes (1)\n");
+	fprintf(stderr, "  -p stream reads through a reader/realignment pipeline instead of windows\n");
+	fprintf(stderr, "  -w bases on each side of a SNP used for realignment, wider windows resolve\n");
+	fprintf(stderr, "     SNPs next to homopolymers but run slower beyond 15 and 31 (15)\n");
+	fprintf(stderr, "  -@ number of extra threads decompressing BAM and VCF files (0)\n");
+	fprintf(stderr, "  -q skip reads with mapping quality below this (20)\n");
+	fprintf(stderr, "  -F skip reads with any of these flags (0x%x: unmapped, secondary, QC fail,\n",
+	        Detect_Options::DEFAULT_EXCLUDE_FLAGS);
+	fprintf(stderr, "     duplicate, supplementary)\n");
+	fprintf(stderr, "  -m skip reads aligned to fewer reference bases than this (0)\n");
+	fprintf(stderr, "  -s skip reads spanning fewer SNPs than this (2)\n");
+	fprintf(stderr, "  -Q take the allele from the aligned base without realignment when its quality\n");
+	fprintf(stderr, "     is at least this and no indel is within -w bases; above 93 disables it (20)\n");
+	fprintf(stderr, "  -L weight alleles by base-quality log-likelihood ratios and resolve edit\n");
+	fprintf(stderr, "     distance ties by the aligned base, instead of equal-weight votes\n");
+	fprintf(stderr, "  -M phase with the exact weighted MEC solver instead of the haplotype tree;\n");
+	fprintf(stderr, "     slower, memory and time grow as 2^coverage\n");
+	fprintf(stderr, "  -C with -M, keep at most this many reads over each SNP (1-%d) (15)\n", MEC_Solver::MAX_COVERAGE);
 	return 1;
 }
 
+/** Per-thread readers, created lazily by the worker that uses them */
+struct Phase_Worker {
+	BAM_Reader bam_reader;
+
+	Phase_Worker(const char *bam_fn, htsThreadPool *pool): bam_reader(bam_fn, pool) {}
+};
+
+/**
+ * Split chr:beg-end into its parts. A name that is a contig on its own
+ * (some contain ':') or has no valid range is taken as a whole chromosome.
+ */
+static void parse_region(const FASTA_Reader &ref_reader, const char *s, std::string &chr, int &beg, int &end) {
+	chr = s; beg = 1; end = INT32_MAX;
+	if (ref_reader.get_length(chr) > 0) return;
+	const char *colon = strrchr(s, ':');
+	if (colon == nullptr) return;
+	int b = 0, e = 0, n = 0;
+	if (sscanf(colon + 1, "%d-%d%n", &b, &e, &n) != 2 or colon[1 + n] != '\0' or b < 1 or e < b) return;
+	chr.assign(s, colon - s); beg = b; end = e;
+}
+
+/** Everything produced for one chromosome, kept until all workers are done */
+struct Phase_Result {
+	Fragment_Matrix fragments;
+	std::vector<int> blocks; /** Phase block of every SNP, see find_phase_blocks */
+	Groups groups;
+};
+
 int main(int argc, char* argv[]) {
     if (argc == 1) return usage();    
 
     const char *bam_fn = nullptr, *vcf_fn = nullptr,  *ref_fn = nullptr, *output_fn = nullptr;
 	const char *request_chromosome = nullptr;
 	const char *resolution_fn = nullptr;
+	int threads = 1, io_threads = 0;
+	bool mec_mode = false; // false: haplotype tree
+	int mec_coverage = 15;
+	Detect_Options detect_opt;
     int c;
-    while ((c = getopt(argc, argv, "b:v:o:c:r:l:R:")) >= 0) {
+    while ((c = getopt(argc, argv, "b:v:o:c:r:l:R:t:@:pw:q:F:m:s:Q:LMC:")) >= 0) {
 		if (c == 'b') {
 			bam_fn = optarg;
 		} else if (c == 'v') {
@@ -33,6 +91,36 @@ int main(int argc, char* argv[]) {
 			request_chromosome = optarg;
 		} else if (c == 'r') {
 			ref_fn = optarg;
+		} else if (c == 't') {
+			threads = atoi(optarg);
+		} else if (c == 'p') {
+			detect_opt.pipeline = true;
+		} else if (c == 'w') {
+			detect_opt.overhang = atoi(optarg);
+		} else if (c == '@') {
+			io_threads = atoi(optarg);
+		} else if (c == 'q') {
+			detect_opt.min_mapq = atoi(optarg);
+		} else if (c == 'F') {
+			detect_opt.exclude_flags = strtol(optarg, nullptr, 0);
+		} else if (c == 'm') {
+			detect_opt.min_aligned_len = atoi(optarg);
+		} else if (c == 's') {
+			detect_opt.min_snps = atoi(optarg);
+		} else if (c == 'Q') {
+			detect_opt.fast_min_baseq = atoi(optarg);
+		} else if (c == 'L') {
+			detect_opt.allele_llr = true;
+		} else if (c == 'M') {
+			mec_mode = true;
+		} else if (c == 'C') {
+			char *e = nullptr;
+			long v = strtol(optarg, &e, 10);
+			if (e == optarg or *e != '\0' or v < 1 or v > MEC_Solver::MAX_COVERAGE) {
+				fprintf(stderr, "ERR: MEC coverage should be an integer between 1 and %d\n", MEC_Solver::MAX_COVERAGE);
+				return 1;
+			}
+			mec_coverage = v;
 		} else return usage();
 	}
 
@@ -42,23 +130,57 @@ int main(int argc, char* argv[]) {
 		fprintf(stderr, "ERR: please provide a reference sequence for detecting alleles by realignment\n" );
 		return 1;
 	}
+	if (threads < 1) { fprintf(stderr, "ERR: number of threads should be positive\n"); return 1; }
+	if (detect_opt.overhang < 1) { fprintf(stderr, "ERR: realignment window should be positive\n"); return 1; }
 
-    auto variant_table = input_vcf(vcf_fn, request_chromosome);
+	// One decompression pool shared by the VCF and every BAM reader
+	htsThreadPool io_pool = {nullptr, 0};
+	if (io_threads > 0 and (io_pool.pool = hts_tpool_init(io_threads)) == nullptr) {
+		fprintf(stderr, "ERR: can not create a pool of %d threads\n", io_threads);
+		return 1;
+	}
 
     FASTA_Reader ref_reader(ref_fn);
-    
+
+	// -c chr:beg-end restricts both the variants and the reference that is loaded
+	std::string region_chr; int region_beg = 1, region_end = INT32_MAX;
+	if (request_chromosome) parse_region(ref_reader, request_chromosome, region_chr, region_beg, region_end);
+	const bool has_region = region_end != INT32_MAX;
+
+    auto variant_table = input_vcf(vcf_fn, request_chromosome ? region_chr.c_str() : nullptr, &io_pool,
+	                               region_beg, region_end);
+
+	// Schedule the largest chromosomes first so that chr1 does not start last
+	std::vector<int> order(variant_table.size);
+	for (int i = 0; i < variant_table.size; i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return ref_reader.get_length(variant_table.chromosomes[a]) > ref_reader.get_length(variant_table.chromosomes[b]);
+	});
+
+	// BAM handles can not be shared, every worker opens its own; the reference is shared
+	// Threads left over by the chromosome pool go to windows inside each chromosome
+	const int chr_threads = std::min(threads, variant_table.size);
+	detect_opt.threads = std::max(1, threads / chr_threads);
+	std::vector<std::unique_ptr<Phase_Worker>> workers(chr_threads);
+	std::vector<Phase_Result> results(variant_table.size);
+
     // enumerate chrs
-    for (int i = 0; i < variant_table.size; i ++) { // 遍历所有染色体	
+	parallel_for(variant_table.size, chr_threads, [&](int k, int tid) {
+		if (workers[tid] == nullptr) workers[tid].reset(new Phase_Worker(bam_fn, &io_pool));
+		auto &worker = *workers[tid];
+		int i = order[k]; // 遍历所有染色体
         const auto &chr_name = variant_table.chromosomes[i];
 		auto &snp_column = variant_table.variants[i]; // 对应染色体的所有snp
-		fprintf(stderr, "Phase %ld SNPs on chromosome %s\n", snp_column.size(), chr_name.c_str());
+		auto &result = results[i];
+		fprintf(stderr, "Phase %d SNPs on chromosome %s\n", snp_column.size(), chr_name.c_str());
 
 		// Detecting alleles (include Realignment)
         int length = ref_reader.get_length(chr_name); assert(length > 0); // 获取染色体的长度
-        char *sequence = ref_reader.get_contig(chr_name); // 获取染色体的序列
-        std::vector<Read_Allele> read_row;
-        read_row = detect_allele(bam_fn, chr_name, snp_column, length, sequence); // 检测 allele, 并进行realignment，返回的是所有 read 的 SNP 和 allele
-        delete [] sequence;
+        // 获取染色体的序列, 2-bit 编码; 指定区域时只读取区域两侧各 overhang 的范围
+        const int pad = detect_opt.overhang + 1;
+        auto sequence = has_region ? ref_reader.get_packed_region(chr_name, region_beg - 1 - pad, region_end + pad)
+                                   : ref_reader.get_packed_contig(chr_name);
+        result.fragments = detect_allele(worker.bam_reader, chr_name, snp_column, sequence, detect_opt); // 检测 allele, 并进行realignment，返回的是所有 read 的 SNP 和 allele
 
 
 		/**
@@ -66,9 +188,96 @@ int main(int argc, char* argv[]) {
 		 * 这样的话，先有分组，再有建树
 		 * 可以将树的根节点信息存储在组中
 		 */
+		// 先用并查集找出 reads 连通的 SNP 块, 分组不跨越不连通的区域
+		result.blocks = find_phase_blocks(result.fragments, snp_column.size());
 		// group SNPs by chunkL & chunkV
-		auto groups = group_snps(snp_column);
+		result.groups = group_snps(snp_column, result.blocks);
 
 		// create haplotype tree for each group
-    }
-}
\ No newline at end of file
+		// 各组独立定相, 线程数不影响结果; 每个线程一棵树 (或一个 MEC solver)
+		const auto &groups = result.groups;
+		std::vector<std::vector<int8_t>> haps(groups.size());
+		std::vector<std::vector<int>> cuts(groups.size()); // MEC: 下采样后不再连通的位置
+		std::vector<std::unique_ptr<HPTree>> trees(detect_opt.threads);
+		std::vector<std::unique_ptr<MEC_Solver>> solvers(detect_opt.threads);
+		parallel_for(groups.size(), detect_opt.threads, [&](int g, int t) {
+			if (mec_mode) {
+				if (solvers[t] == nullptr) solvers[t].reset(new MEC_Solver(result.fragments, mec_coverage));
+				solvers[t]->phase(groups[g].snp_beg, groups[g].snp_end, haps[g], cuts[g]);
+			} else {
+				if (trees[t] == nullptr) trees[t].reset(new HPTree(result.fragments));
+				trees[t]->phase(groups[g].snp_beg, groups[g].snp_end, haps[g]);
+			}
+		});
+		trees.clear(); solvers.clear();
+
+		// Stitch neighbouring segments in genomic order by the reads spanning their boundary:
+		// keep or flip the right segment, or start a new phase set when no read links them.
+		// A segment is a group, or a part of it between the cuts of the MEC solver; the phase
+		// across a cut is arbitrary, so a new phase set always starts there
+		// 每段的第一个定相 SNP 的位置作为 PS
+		int ps = -1, l_beg = -1, l_end = -1, l_group = -1;
+		bool flip = false;
+		for (int g = 0; g < groups.size(); g++) {
+			const int g_beg = groups[g].snp_beg;
+			const auto &hap = haps[g];
+			for (int c = 0; c <= cuts[g].size(); c++) {
+				const int beg = c == 0 ? g_beg : cuts[g][c-1];
+				const int end = c == cuts[g].size() ? groups[g].snp_end : cuts[g][c];
+				int first = beg;
+				while (first < end and hap[first - g_beg] < 0) first++;
+				if (first == end) continue; // No read allele in the segment
+
+				long vote = 0;
+				if (l_group >= 0 and c == 0) {
+					vote = stitch_vote(result.fragments, l_beg, l_end, haps[l_group].data() + (l_beg - groups[l_group].snp_beg),
+					                   beg, end, hap.data() + (beg - g_beg));
+				}
+				if (vote == 0) { ps = snp_column.pos[first]; flip = false; }
+				else if (vote < 0) flip = not flip;
+				for (int j = first; j < end; j++) {
+					if (hap[j - g_beg] < 0) continue;
+					snp_column.gt[j] = hap[j - g_beg] ^ flip;
+					snp_column.ps[j] = ps;
+				}
+				l_beg = beg; l_end = end; l_group = g;
+			}
+		}
+
+		// SNPs of one stitched run may belong to interleaved blocks that no read connects,
+		// split such runs so that a phase set never mixes blocks
+		std::map<std::pair<int, int>, int> phase_sets;
+		for (int j = 0; j < snp_column.size(); j++) {
+			if (snp_column.gt[j] < 0) continue;
+			auto key = std::make_pair(snp_column.ps[j], result.blocks[j]);
+			snp_column.ps[j] = phase_sets.emplace(key, snp_column.pos[j]).first->second;
+		}
+	});
+	workers.clear();
+	ref_reader.close();
+	if (io_pool.pool != nullptr) hts_tpool_destroy(io_pool.pool);
+
+	// Merge back in input order
+	for (int i = 0; i < variant_table.size; i++) {
+		const auto &snp_column = variant_table.variants[i];
+		const auto &blocks = results[i].blocks;
+		int phased = 0, block_n = 0, largest = 0;
+		std::vector<int> block_size(snp_column.size(), 0);
+		for (int j = 0; j < snp_column.size(); j++) {
+			phased += snp_column.gt[j] >= 0;
+			if (++block_size[blocks[j]] == 2) block_n++;
+			largest = std::max(largest, block_size[blocks[j]]);
+		}
+		fprintf(stderr, "Chromosome %s: %d informative reads, %ld groups, %d SNPs phased\n",
+		        variant_table.chromosomes[i].c_str(), results[i].fragments.rows(), results[i].groups.size(), phased);
+		fprintf(stderr, "    %d phase blocks of 2+ SNPs, the largest has %d SNPs\n", block_n, largest);
+		const auto &fragments = results[i].fragments;
+		int max_coverage = 0;
+		for (int j = 0; j < snp_column.size(); j++) max_coverage = std::max(max_coverage, fragments.coverage(j));
+		fprintf(stderr, "    %ld alleles in %.1f MB, %.1f reads per SNP on average, at most %d\n", fragments.entries(),
+		        fragments.memory() / 1048576.0, snp_column.empty() ? 0.0 : (double)fragments.entries() / snp_column.size(),
+		        max_coverage);
+	}
+	output_vcf(output_fn, variant_table);
+	return 0;
+}
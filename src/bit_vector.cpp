@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <vector>
+
+#include "bit_vector.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BV_X86 1
+#endif
+
+/** One DP column of the recurrence, shared by the scalar kernels */
+template <typename Word>
+static inline void bv_step(Word eq, Word HIGH_SET, Word &pv, Word &mv, int &score) {
+	Word xv = eq | mv;
+	Word xh = (((eq & pv) + pv) ^ pv) | eq;
+
+	Word ph = mv | (~ (xh | pv));
+	Word mh = pv & xh;
+
+	if ((ph & HIGH_SET) != 0) ++score;
+	else if ((mh & HIGH_SET) != 0) --score;
+
+	ph = (ph << 1u) | 1u; // This is different from Myers' paper; our first row is 1,2,3...
+	mh <<= 1u;
+	pv = mh | (~(xv | ph));
+	mv = ph & xv;
+}
+
+int bit_vector_scalar(const BV_Task &task) {
+	if (task.q_len == 0) return task.t_len;
+	uint32_t pv = ~0u, mv = 0u; // The first column vertical
+	int score = task.q_len; // Initial score
+	const uint32_t HIGH_SET = (1u << (task.q_len-1));
+	for (int j = 1; j <= task.t_len; j++) { // DP loop
+		bv_step(task.peq[task.text[j]], HIGH_SET, pv, mv, score);
+	}
+	return score;
+}
+
+template <typename Word>
+std::pair<int, int> bit_vector_fork(const Word *peq, int q_len, const uint8_t *ref, const uint8_t *alt,
+                                    int t_len, int col) {
+	if (q_len == 0) return std::make_pair(t_len, t_len);
+	col = std::max(1, std::min(col, t_len + 1));
+	Word pv = ~(Word)0, mv = 0;
+	int score = q_len;
+	const Word HIGH_SET = (Word)1 << (q_len-1);
+	for (int j = 1; j < col; j++) { // Shared prefix
+		bv_step(peq[ref[j]], HIGH_SET, pv, mv, score);
+	}
+
+	Word alt_pv = pv, alt_mv = mv; // Fork at the SNP column
+	int alt_score = score;
+	for (int j = col; j <= t_len; j++) {
+		bv_step(peq[ref[j]], HIGH_SET, pv, mv, score);
+		bv_step(peq[alt[j]], HIGH_SET, alt_pv, alt_mv, alt_score);
+	}
+	return std::make_pair(score, alt_score);
+}
+
+template std::pair<int, int> bit_vector_fork<uint32_t>(const uint32_t *, int, const uint8_t *, const uint8_t *, int, int);
+template std::pair<int, int> bit_vector_fork<uint64_t>(const uint64_t *, int, const uint8_t *, const uint8_t *, int, int);
+
+std::pair<int, int> bit_vector_fork(const BV_Task &task, const uint8_t *alt, int col) {
+	return bit_vector_fork<uint32_t>(task.peq, task.q_len, task.text, alt, task.t_len, col);
+}
+
+/**
+ * One column of one 64-bit block (Myers 1999, section 4). Blocks are chained
+ * through the horizontal delta: hin enters at the top row of the block and
+ * the delta leaving its bottom row is returned.
+ */
+static inline int bv_block_step(uint64_t eq, int hin, uint64_t &pv, uint64_t &mv) {
+	const uint64_t HIGH_SET = 1ull << 63u;
+	uint64_t xv = eq | mv;
+	if (hin < 0) eq |= 1ull;
+	uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+
+	uint64_t ph = mv | (~ (xh | pv));
+	uint64_t mh = pv & xh;
+
+	int hout = 0;
+	if ((ph & HIGH_SET) != 0) hout = 1;
+	else if ((mh & HIGH_SET) != 0) hout = -1;
+
+	ph <<= 1u;
+	mh <<= 1u;
+	if (hin < 0) mh |= 1ull;
+	else if (hin > 0) ph |= 1ull;
+	pv = mh | (~(xv | ph));
+	mv = ph & xv;
+	return hout;
+}
+
+/** Run columns [from, to] of text over all blocks, the score is read at row q_len */
+static void bv_blocked_columns(const uint64_t *peq, int words, int q_len, const uint8_t *text, int from, int to,
+                               uint64_t *pv, uint64_t *mv, int &score) {
+	const int last = words - 1;
+	const int last_bit = (q_len - 1) % 64;
+	for (int j = from; j <= to; j++) {
+		const uint64_t *eq = peq + (size_t)text[j] * words;
+		int hin = 1; // The first row is 0,1,2,...
+		for (int w = 0; w < last; w++) hin = bv_block_step(eq[w], hin, pv[w], mv[w]);
+
+		// In the last block the score row may be below bit 63
+		uint64_t pv_old = pv[last], mv_old = mv[last];
+		uint64_t xv = eq[last] | mv_old;
+		uint64_t e = eq[last] | (hin < 0 ?1ull :0ull);
+		uint64_t xh = (((e & pv_old) + pv_old) ^ pv_old) | e;
+		uint64_t ph = mv_old | (~ (xh | pv_old));
+		uint64_t mh = pv_old & xh;
+		if ((ph >> last_bit) & 1u) ++score;
+		else if ((mh >> last_bit) & 1u) --score;
+		ph <<= 1u;
+		mh <<= 1u;
+		if (hin < 0) mh |= 1ull;
+		else if (hin > 0) ph |= 1ull;
+		pv[last] = mh | (~(xv | ph));
+		mv[last] = ph & xv;
+	}
+}
+
+std::pair<int, int> bit_vector_fork_blocked(const uint64_t *peq, int words, int q_len, const uint8_t *ref,
+                                            const uint8_t *alt, int t_len, int col) {
+	if (q_len == 0) return std::make_pair(t_len, t_len);
+	col = std::max(1, std::min(col, t_len + 1));
+	std::vector<uint64_t> state(words * 4);
+	uint64_t *pv = state.data(), *mv = pv + words, *alt_pv = mv + words, *alt_mv = alt_pv + words;
+	std::fill(pv, pv + words, ~0ull);
+	std::fill(mv, mv + words, 0ull);
+	int score = q_len;
+	bv_blocked_columns(peq, words, q_len, ref, 1, col - 1, pv, mv, score); // Shared prefix
+
+	std::copy(pv, pv + words, alt_pv); // Fork at the SNP column
+	std::copy(mv, mv + words, alt_mv);
+	int alt_score = score;
+	bv_blocked_columns(peq, words, q_len, ref, col, t_len, pv, mv, score);
+	bv_blocked_columns(peq, words, q_len, alt, col, t_len, alt_pv, alt_mv, alt_score);
+	return std::make_pair(score, alt_score);
+}
+
+#ifdef BV_X86
+/**
+ * The vector kernels run the scalar recurrence lane by lane. Lanes with a
+ * shorter text keep iterating on eq = 0 but their scores are frozen by the
+ * active mask; lanes with an empty query have HIGH_SET = 0 and are fixed up
+ * by the caller.
+ */
+__attribute__((target("avx2")))
+static void batch_avx2(const BV_Task *tasks, int *scores) {
+	const int LANES = 8;
+	alignas(32) uint32_t eq_buf[LANES], high_buf[LANES];
+	alignas(32) int32_t q_buf[LANES], t_buf[LANES];
+	int max_t = 0;
+	for (int l = 0; l < LANES; l++) {
+		q_buf[l] = tasks[l].q_len;
+		t_buf[l] = tasks[l].t_len;
+		high_buf[l] = tasks[l].q_len > 0 ?1u << (tasks[l].q_len-1) :0u;
+		max_t = std::max(max_t, tasks[l].t_len);
+	}
+
+	const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi32(-1), one = _mm256_set1_epi32(1);
+	const __m256i high = _mm256_load_si256((const __m256i *)high_buf);
+	const __m256i t_len = _mm256_load_si256((const __m256i *)t_buf);
+	__m256i pv = ones, mv = zero;
+	__m256i score = _mm256_load_si256((const __m256i *)q_buf);
+	for (int j = 1; j <= max_t; j++) {
+		for (int l = 0; l < LANES; l++) {
+			eq_buf[l] = j <= tasks[l].t_len ?tasks[l].peq[tasks[l].text[j]] :0u;
+		}
+		__m256i eq = _mm256_load_si256((const __m256i *)eq_buf);
+		__m256i active = _mm256_cmpgt_epi32(t_len, _mm256_set1_epi32(j - 1));
+		__m256i xv = _mm256_or_si256(eq, mv);
+		__m256i xh = _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi32(_mm256_and_si256(eq, pv), pv), pv), eq);
+
+		__m256i ph = _mm256_or_si256(mv, _mm256_xor_si256(_mm256_or_si256(xh, pv), ones));
+		__m256i mh = _mm256_and_si256(pv, xh);
+
+		// All-ones where the bit is set; ph and mh never share the high bit
+		__m256i inc = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(ph, high), zero), active);
+		__m256i dec = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(mh, high), zero), active);
+		score = _mm256_add_epi32(_mm256_sub_epi32(score, inc), dec);
+
+		ph = _mm256_or_si256(_mm256_slli_epi32(ph, 1), one);
+		mh = _mm256_slli_epi32(mh, 1);
+		pv = _mm256_or_si256(mh, _mm256_xor_si256(_mm256_or_si256(xv, ph), ones));
+		mv = _mm256_and_si256(ph, xv);
+	}
+	_mm256_storeu_si256((__m256i *)scores, score);
+}
+
+__attribute__((target("avx512f")))
+static void batch_avx512(const BV_Task *tasks, int *scores) {
+	const int LANES = 16;
+	alignas(64) uint32_t eq_buf[LANES], high_buf[LANES];
+	alignas(64) int32_t q_buf[LANES], t_buf[LANES];
+	int max_t = 0;
+	for (int l = 0; l < LANES; l++) {
+		q_buf[l] = tasks[l].q_len;
+		t_buf[l] = tasks[l].t_len;
+		high_buf[l] = tasks[l].q_len > 0 ?1u << (tasks[l].q_len-1) :0u;
+		max_t = std::max(max_t, tasks[l].t_len);
+	}
+
+	const __m512i zero = _mm512_setzero_si512(), ones = _mm512_set1_epi32(-1), one = _mm512_set1_epi32(1);
+	const __m512i high = _mm512_load_si512(high_buf);
+	const __m512i t_len = _mm512_load_si512(t_buf);
+	__m512i pv = ones, mv = zero;
+	__m512i score = _mm512_load_si512(q_buf);
+	for (int j = 1; j <= max_t; j++) {
+		for (int l = 0; l < LANES; l++) {
+			eq_buf[l] = j <= tasks[l].t_len ?tasks[l].peq[tasks[l].text[j]] :0u;
+		}
+		__m512i eq = _mm512_load_si512(eq_buf);
+		__mmask16 active = _mm512_cmpgt_epi32_mask(t_len, _mm512_set1_epi32(j - 1));
+		__m512i xv = _mm512_or_si512(eq, mv);
+		__m512i xh = _mm512_or_si512(_mm512_xor_si512(_mm512_add_epi32(_mm512_and_si512(eq, pv), pv), pv), eq);
+
+		__m512i ph = _mm512_or_si512(mv, _mm512_xor_si512(_mm512_or_si512(xh, pv), ones));
+		__m512i mh = _mm512_and_si512(pv, xh);
+
+		__mmask16 inc = _mm512_mask_test_epi32_mask(active, ph, high);
+		__mmask16 dec = _mm512_mask_test_epi32_mask(active, mh, high);
+		score = _mm512_mask_add_epi32(score, inc, score, one);
+		score = _mm512_mask_sub_epi32(score, dec, score, one);
+
+		ph = _mm512_or_si512(_mm512_add_epi32(ph, ph), one); // x + x is x << 1
+		mh = _mm512_add_epi32(mh, mh);
+		pv = _mm512_or_si512(mh, _mm512_xor_si512(_mm512_or_si512(xv, ph), ones));
+		mv = _mm512_and_si512(ph, xv);
+	}
+	_mm512_storeu_si512(scores, score);
+}
+#endif
+
+int bit_vector_lanes(BV_Kernel kernel) {
+	return kernel == BV_AVX512 ?16 :kernel == BV_AVX2 ?8 :1;
+}
+
+BV_Kernel bit_vector_kernel() {
+#ifdef BV_X86
+	static const BV_Kernel kernel = __builtin_cpu_supports("avx512f") ?BV_AVX512
+	                              : __builtin_cpu_supports("avx2") ?BV_AVX2 :BV_SCALAR;
+	return kernel;
+#else
+	return BV_SCALAR;
+#endif
+}
+
+void bit_vector_batch(const BV_Task *tasks, int n, int *scores, BV_Kernel kernel) {
+	int i = 0;
+#ifdef BV_X86
+	if (kernel == BV_AVX512) {
+		for (; i + 16 <= n; i += 16) batch_avx512(tasks + i, scores + i);
+	}
+	if (kernel >= BV_AVX2) {
+		for (; i + 8 <= n; i += 8) batch_avx2(tasks + i, scores + i);
+	}
+	for (int k = 0; k < i; k++) {
+		if (tasks[k].q_len == 0) scores[k] = tasks[k].t_len;
+	}
+#endif
+	for (; i < n; i++) scores[i] = bit_vector_scalar(tasks[i]);
+}
@@ -3,10 +3,20 @@
 #include <memory.h>
 #include <cassert>
 #include <fstream>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "data_reader.h"
 #include "sam.h"
+#include "kseq.h"
 #include "realignment.h"
+#include "group.h"
+#include "parallel.h"
 
 void VCF_Header::addLine(const char *buf) {
 	if (buf[0] == '#' and buf[1] == '#') {
@@ -34,8 +44,8 @@ void VCF_Header::annotate_for_phasing() {
 			if (values[i].find("ID=PS") != std::string::npos) has_ps = true;
 		}
 	}
-	if (not has_gt) addLine("<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
-	if (not has_ps) addLine("<ID=PS,Number=1,Type=Integer,Description=\"Phase Set\">");
+	if (not has_gt) addLine("##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+	if (not has_ps) addLine("##FORMAT=<ID=PS,Number=1,Type=Integer,Description=\"Phase Set\">");
 }
 
 std::vector<std::string> VCF_Header::to_str() {
@@ -47,48 +57,70 @@ std::vector<std::string> VCF_Header::to_str() {
 	return ret;
 }
 
-Variant_Table input_vcf(const char *fn, const char* chromosome) {
-    gzFile in = gzopen(fn, "r");
+Variant_Table input_vcf(const char *fn, const char* chromosome, htsThreadPool *pool, int beg, int end) {
+    htsFile *in = hts_open(fn, "r"); // Plain, gzip or bgzip; bgzip blocks are inflated by the pool
     if(in == nullptr) {
         fprintf(stderr, "ERR: open vcf file %s falied.\n", fn);
         std::abort();
     }
+    if (pool != nullptr and pool->pool != nullptr and hts_set_thread_pool(in, pool) != 0) {
+        fprintf(stderr, "WARN: can not decompress %s in the thread pool\n", fn);
+    }
 
-    Variant_Table vt; vt.size = 0;
-    const int SNP_BUF_SIZE = 4 * 1024 * 1024;
-    char *buf = new char[SNP_BUF_SIZE];
+    Variant_Table vt;
+    kstring_t line = {0, 0, nullptr};
     std::map<std::string, int> dict;
-    
-    while(gzgets(in, buf, SNP_BUF_SIZE) != nullptr) {
-    //     // 首先读header, VCF_Header的addLine处理的字符串末尾是\0，
-    //     // 但是gzgets会读到\n并保存，所以首先将读到的一行末尾改成\n.
+    const int chromosome_len = chromosome ? strlen(chromosome) : 0;
+    int last_idx = -1; // 同一染色体的记录是连续的, 缓存上一条记录的染色体
+    std::string last_name;
+    VCF_Record rec;
+
+    while(hts_getline(in, KS_SEP_LINE, &line) >= 0) {
+        // hts_getline 去掉了行尾的\n, 所以header和SNP的line都不带换行符
+        const char *buf = line.s;
         if(buf[0] == '#') { vt.header.addLine(buf); continue;}
-        
-        // 录入染色体
-        auto fields = split_str(buf, '\t');
-        const auto &chr = fields[VCF_CHROM];
-        if (chromosome and chr != std::string(chromosome)) continue;
 
-        int pos = stoi(fields[VCF_POS]);
+        if(not scan_vcf_record(buf, rec)) {
+            fprintf(stderr, "ERR: malformed vcf record: %s\n", buf);
+            std::abort();
+        }
+        // 所有记录都保存下来, 输出时原样写回未定相的记录
+        const uint64_t off = vt.add_line(buf, line.l);
+        vt.records.push_back(off);
+        if (chromosome and not rec.chrom.equals(chromosome, chromosome_len)) continue;
+
+        int pos = parse_int(rec.pos);
+        if (pos < 0) {
+            fprintf(stderr, "ERR: invalid POS in vcf record: %s\n", buf);
+            std::abort();
+        }
+        if (pos < beg or pos > end) continue;
 
-        if(fields[VCF_REF].size() != 1 or fields[VCF_ALT].size() != 1) { continue; } // not a SNV
-        char ref = fields[VCF_REF][0];
-        char alt = fields[VCF_ALT][0];
+        if(rec.ref.len != 1 or rec.alt.len != 1) { continue; } // not a SNV
+        // 纯合位点无需定相, 例如 0/0, 1/1
+        if(rec.gt.len == 3 and rec.gt.s[0] != '.' and rec.gt.s[0] == rec.gt.s[2]) { continue; }
+        char ref = rec.ref.s[0];
+        char alt = rec.alt.s[0];
 
         // 因为在Variant_Table中,chr和SNPs是以index作对应的,所以在这里进行中间情况的保存
-        if(dict.find(chr) == dict.end()) { // 当前chr第一次出现
-            vt.chromosomes.push_back(chr);
-            vt.variants.emplace_back(std::vector<SNP>());
-            vt.size++;
-            dict[chr] = vt.size - 1;
+        if(last_idx < 0 or not rec.chrom.equals(last_name.data(), last_name.size())) {
+            last_name = rec.chrom.str();
+            auto it = dict.find(last_name);
+            if(it == dict.end()) { // 当前chr第一次出现
+                vt.chromosomes.push_back(last_name);
+                vt.variants.emplace_back(SNP_Column());
+                vt.size++;
+                it = dict.emplace(last_name, vt.size - 1).first;
+            }
+            last_idx = it->second;
         }
-        
-        vt.variants[dict[chr]].emplace_back(SNP(pos, ref, alt, buf));
+
+        vt.variants[last_idx].push_back(pos, ref, alt, off);
 
     }
 
-    delete[] buf;
-    gzclose(in);
+    free(line.s);
+    hts_close(in);
 
     if (vt.size == 0) {
 		fprintf(stderr, "ERR: input no variants to phase\n");
@@ -98,13 +130,128 @@ Variant_Table input_vcf(const char *fn, const char* chromosome) {
 	int snp_n = 0;
 	for (auto &variant: vt.variants) {
 		snp_n += variant.size();
-		std::sort(variant.begin(), variant.end());
+		variant.sort();
 	}
     // std::cout << snp_n << std::endl;
 
     return vt;
 }
 
+/**
+ * Rewrite GT and PS of the first sample in @param line, adding the keys to FORMAT
+ * when they are missing (GT first, PS last); other samples are left untouched.
+ */
+static void write_phased_line(FILE *out, const char *line, int8_t gt, int ps) {
+    std::vector<std::string> cols;
+    for (const char *p = line; ; p++) { // split_str drops empty columns, keep them here
+        const char *q = strchr(p, '\t');
+        if (q == nullptr) { cols.emplace_back(p); break; }
+        cols.emplace_back(p, q - p);
+        p = q;
+    }
+    if (cols.size() <= VCF_SAMPLE) { fprintf(out, "%s\n", line); return; }
+
+    auto keys = split_str(cols[VCF_FORMAT].c_str(), ':'), values = split_str(cols[VCF_SAMPLE].c_str(), ':');
+    values.resize(std::max(values.size(), keys.size()), ".");
+    if (keys.empty() or keys[0] != "GT") { keys.insert(keys.begin(), "GT"); values.insert(values.begin(), "."); }
+    auto it = std::find(keys.begin(), keys.end(), "PS");
+    if (it == keys.end()) { keys.push_back("PS"); values.insert(values.begin() + keys.size() - 1, "."); it = keys.end() - 1; }
+    values[0] = gt == 0 ? "0|1" : "1|0";
+    values[it - keys.begin()] = std::to_string(ps);
+
+    cols[VCF_FORMAT] = keys[0]; cols[VCF_SAMPLE] = values[0];
+    for (int i = 1; i < keys.size(); i++) cols[VCF_FORMAT] += ':' + keys[i];
+    for (int i = 1; i < values.size(); i++) cols[VCF_SAMPLE] += ':' + values[i];
+    for (int i = 0; i < cols.size(); i++) fprintf(out, i ? "\t%s" : "%s", cols[i].c_str());
+    fputc('\n', out);
+}
+
+void output_vcf(const char *fn, Variant_Table &vt) {
+    FILE *out = fn ? fopen(fn, "w") : stdout;
+    if (out == nullptr) {
+        fprintf(stderr, "ERR: can not open output file %s\n", fn);
+        std::abort();
+    }
+    vt.header.annotate_for_phasing();
+    for (const auto &l : vt.header.to_str()) fprintf(out, "%s\n", l.c_str());
+    // Phased SNVs by arena offset, which follows the input order of the records
+    std::vector<std::pair<uint64_t, std::pair<int, int>>> phased;
+    for (int c = 0; c < vt.size; c++) {
+        const auto &snps = vt.variants[c];
+        for (int i = 0; i < snps.size(); i++) {
+            if (snps.gt[i] >= 0) phased.push_back(std::make_pair(snps.line_off[i], std::make_pair(c, i)));
+        }
+    }
+    std::sort(phased.begin(), phased.end());
+    size_t k = 0;
+    for (uint64_t off : vt.records) {
+        const char *line = vt.lines.data() + off;
+        if (k < phased.size() and phased[k].first == off) {
+            const auto &snps = vt.variants[phased[k].second.first];
+            const int i = phased[k].second.second;
+            write_phased_line(out, line, snps.gt[i], snps.ps[i]);
+            k++;
+        } else fprintf(out, "%s\n", line);
+    }
+    if (fn) fclose(out);
+}
+
+bool scan_vcf_record(const char *line, VCF_Record &rec) {
+    Field *cols[VCF_ALT + 1] = {&rec.chrom, &rec.pos, nullptr, &rec.ref, &rec.alt};
+    Field format;
+    rec.gt = Field();
+
+    // 逐列扫描, 只记录需要的列, 读到第一个样本为止
+    const char *p = line;
+    for(int col = 0; col <= VCF_SAMPLE; col++) {
+        const char *q = strchr(p, '\t');
+        int len = q ? q - p : strlen(p);
+        if(col <= VCF_ALT and cols[col]) { cols[col]->s = p; cols[col]->len = len; }
+        else if(col == VCF_FORMAT) { format.s = p; format.len = len; }
+        else if(col == VCF_SAMPLE and format.len >= 2 and memcmp(format.s, "GT", 2) == 0
+                and (format.len == 2 or format.s[2] == ':')) {
+            const char *colon = (const char *) memchr(p, ':', len);
+            rec.gt.s = p; rec.gt.len = colon ? colon - p : len;
+        }
+        if(q == nullptr) return col >= VCF_ALT;
+        p = q + 1;
+    }
+    return true;
+}
+
+int parse_int(const Field &f) {
+    if(f.len == 0 or f.len > 10) return -1;
+    long v = 0;
+    for(int i = 0; i < f.len; i++) {
+        if(f.s[i] < '0' or f.s[i] > '9') return -1;
+        v = v * 10 + (f.s[i] - '0');
+    }
+    return v <= INT32_MAX ? (int) v : -1;
+}
+
+void SNP_Column::push_back(int p, char r, char a, uint64_t off) {
+    pos.push_back(p); ref.push_back(r); alt.push_back(a);
+    line_off.push_back(off);
+    ps.push_back(-1); gt.push_back(-1);
+}
+
+template <typename T>
+static void permute(std::vector<T> &v, const std::vector<int> &order) {
+    std::vector<T> t(v.size());
+    for (int i = 0; i < order.size(); i++) t[i] = v[order[i]];
+    v.swap(t);
+}
+
+void SNP_Column::sort() {
+    if (std::is_sorted(pos.begin(), pos.end())) return; // VCF is usually sorted already
+    std::vector<int> order(size());
+    for (int i = 0; i < size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return pos[a] < pos[b]; });
+    permute(pos, order); permute(ref, order); permute(alt, order);
+    permute(line_off, order);
+    permute(ps, order); permute(gt, order);
+}
+
 std::vector<std::string> split_str(const char *s, char sep) {
     std::vector<std::string> ret;
     std::string temp;
@@ -123,13 +270,34 @@ std::vector<std::string> split_str(const char *s, char sep) {
     return ret;
 }
 
-FASTA_Reader::FASTA_Reader(const std::string &fn) {
-    ref_fp = gzopen(fn.c_str(), "r");
-    if(ref_fp == nullptr) {
+FASTA_Reader::FASTA_Reader(const std::string &fn): fn(fn), map_base(nullptr), map_size(0), fai(nullptr) {
+    int fd = open(fn.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 or fstat(fd, &st) != 0) {
         fprintf(stderr, "ERR: open fasta file %s failed. \n", fn.c_str());
         std::abort();
     }
 
+    // gzip 魔数 1f 8b: bgzip 压缩的参考序列交给 faidx (需要 .fai 和 .gzi)
+    unsigned char magic[2] = {0, 0};
+    if(pread(fd, magic, 2, 0) == 2 and magic[0] == 0x1f and magic[1] == 0x8b) {
+        ::close(fd);
+        fai = fai_load_format(fn.c_str(), FAI_FASTA);
+        if(fai == nullptr) {
+            fprintf(stderr, "ERR: load bgzip fasta %s failed, index with `samtools faidx`\n", fn.c_str());
+            std::abort();
+        }
+    } else {
+        map_size = st.st_size;
+        void *p = map_size ? mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+        ::close(fd);
+        if(p == MAP_FAILED) {
+            fprintf(stderr, "ERR: mmap fasta file %s failed. \n", fn.c_str());
+            std::abort();
+        }
+        map_base = (const char *) p;
+    }
+
     std::ifstream in(fn + ".fai");
     if(!in.is_open()) {
         fprintf(stderr, "ERR: reference sequence is not indexed. Use `samtools faidx`\n");
@@ -139,14 +307,31 @@ FASTA_Reader::FASTA_Reader(const std::string &fn) {
     auto *line_buf = new char[4 * 1024];
     while ( in.getline(line_buf, 4 * 1024)) {
         auto idxs = split_str(line_buf, '\t');
+        if (idxs.size() < 5) {
+            fprintf(stderr, "ERR: malformed line in %s.fai: %s\n", fn.c_str(), line_buf);
+            std::abort();
+        }
         std::string chr = idxs[0];
 
         FAIDX_Contig t;
         int length = std::stoi(idxs[1]);
-        int offset = std::stoi(idxs[2]);
+        long offset = std::stol(idxs[2]);
         int line_bases = std::stoi(idxs[3]);
         int line_width = std::stoi(idxs[4]);
-        
+        if (length < 0 or offset < 0 or line_bases <= 0 or line_width < line_bases) {
+            fprintf(stderr, "ERR: invalid index of contig %s in %s.fai\n", chr.c_str(), fn.c_str());
+            std::abort();
+        }
+        // 映射的文件里直接按 .fai 寻址, 过期或不匹配的索引会越界读
+        if (map_base != nullptr and length > 0) {
+            const long last = offset + (long)((length - 1) / line_bases) * line_width + (length - 1) % line_bases;
+            if (last >= (long)map_size) {
+                fprintf(stderr, "ERR: contig %s ends beyond %s, the .fai index is stale or belongs to another file. "
+                        "Re-index with `samtools faidx`\n", chr.c_str(), fn.c_str());
+                std::abort();
+            }
+        }
+
         t.length = length; t.offset = offset; t.line_bases = line_bases; t.line_width = line_width;
 
         dict[chr] = t;
@@ -173,162 +358,522 @@ void newlinein(const char *str) {
 
 char * FASTA_Reader::get_contig(const std::string &chr_name) {
 
-    const auto &faidx = dict[chr_name];
-    char * ref = new char[faidx.length + 5]; int length = 0;
-    gzseek(ref_fp, faidx.offset, SEEK_SET);
-    char * buffer = new char[faidx.line_width + 5];
+    const auto &faidx = dict.at(chr_name);
+    char * ref = new char[faidx.length + 5];
+
+    if(map_base == nullptr) {
+        int length = 0;
+        char *seq;
+        {
+            std::lock_guard<std::mutex> lock(fai_lock);
+            seq = faidx_fetch_seq(fai, chr_name.c_str(), 0, faidx.length - 1, &length);
+        }
+        if(seq == nullptr or length != faidx.length) {
+            fprintf(stderr, "ERR: fetch contig %s failed. \n", chr_name.c_str());
+            std::abort();
+        }
+        memcpy(ref, seq, length);
+        free(seq);
+        return ref;
+    }
 
-    // 不能用类似gzgets.. != nullptr.
-    // 因为我们只要目标染色体的序列
-    // 并且我们知道其偏移量和碱基长度,所以可以用长度来控制序列的读取
-    while (length < faidx.length) {
-        gzgets(ref_fp, buffer, faidx.line_width + 5);
+    // 按行拷贝, 跳过每行末尾的换行符
+    const char *text = map_base + faidx.offset;
+    for(int length = 0; length < faidx.length; length += faidx.line_bases) {
         int n = std::min(faidx.line_bases, faidx.length - length);
+        memcpy(ref + length, text, n);
+        text += faidx.line_width;
+    }
+    return ref;
+}
+
+Packed_Contig FASTA_Reader::get_packed_contig(const std::string &chr_name) {
+    return get_packed_region(chr_name, 0, dict.at(chr_name).length);
+}
+
+Packed_Contig FASTA_Reader::get_packed_region(const std::string &chr_name, int beg, int end) {
+    const auto &faidx = dict.at(chr_name);
+    beg = std::max(beg, 0); end = std::min(end, faidx.length);
+    if(beg >= end) return Packed_Contig(nullptr, 0, std::min(beg, faidx.length));
 
-        memcpy(ref + length, buffer, n);
-        length += n;
+    if(map_base != nullptr) {
+        return Packed_Contig(map_base + faidx.offset, beg, end, faidx.line_bases, faidx.line_width);
     }
 
-    delete[] buffer;
-    assert(length == faidx.length);
-    return ref;
+    int length = 0;
+    char *seq;
+    {
+        std::lock_guard<std::mutex> lock(fai_lock);
+        seq = faidx_fetch_seq(fai, chr_name.c_str(), beg, end - 1, &length);
+    }
+    if(seq == nullptr or length != end - beg) {
+        fprintf(stderr, "ERR: fetch %s:%d-%d failed. \n", chr_name.c_str(), beg + 1, end);
+        std::abort();
+    }
+    Packed_Contig ret(seq, length, beg);
+    free(seq);
+    return ret;
+}
+
+void FASTA_Reader::close() {
+    if(map_base) munmap((void *) map_base, map_size);
+    if(fai) fai_destroy(fai);
+    map_base = nullptr; map_size = 0; fai = nullptr;
 }
 
-static int binary_search_snp(const std::vector<SNP> &snps, int pos) {
-	int l = 0, r = snps.size() - 1, ret = -1;
-	while (l <= r) {
-		int mid = (l + r) / 2;
-		if (snps[mid].pos < pos) l = mid + 1;
-		else {
-			ret = mid;
-			r = mid - 1;
+/**
+ * Finds the first SNP at or after a position for reads in coordinate order.
+ * The cursor only moves forward by a few SNPs between neighbouring reads, so a
+ * short linear scan is tried first; longer jumps (either way, e.g. between
+ * pipeline batches) gallop from the cursor and finish with a binary search.
+ * Only the position array is touched.
+ */
+class SNP_Cursor {
+private:
+	const std::vector<int> &snp_pos;
+	int cur; /** First SNP at or after the last queried position */
+	static const int LINEAR_STEPS = 8;
+
+public:
+	explicit SNP_Cursor(const std::vector<int> &p): snp_pos(p), cur(0) {}
+
+	/** Index of the first SNP at or after @param pos, -1 if none */
+	int seek(int pos) {
+		const int n = snp_pos.size();
+		int lo, hi; // Answer in [lo, hi]
+		if (cur == n or snp_pos[cur] >= pos) {
+			// Backward (or no move): the answer is at or before cur
+			if (cur == 0 or snp_pos[cur - 1] < pos) return cur < n ? cur : -1;
+			int step = 1; hi = cur - 1;
+			while (hi - step >= 0 and snp_pos[hi - step] >= pos) step *= 2;
+			lo = std::max(hi - step, 0); hi = cur - 1;
+		} else {
+			// Forward: try a few linear steps, then gallop
+			for (int k = 0; k < LINEAR_STEPS; k++) {
+				if (++cur == n or snp_pos[cur] >= pos) return cur < n ? cur : -1;
+			}
+			int step = 1; lo = cur + 1;
+			while (cur + step < n and snp_pos[cur + step] < pos) step *= 2;
+			hi = std::min(cur + step, n);
 		}
+		cur = std::lower_bound(snp_pos.begin() + lo, snp_pos.begin() + hi, pos) - snp_pos.begin();
+		return cur < n ? cur : -1;
 	}
-	return ret;
-}
+};
 
-std::vector<Read_Allele> detect_allele(const char *bam_fn, const std::string &chr_name,
-                                       std::vector<SNP> &snps, int len, const char *seq) {
-    std::vector<Read_Allele> ret; int total_allele = 0;
-    samFile *bam_fp = sam_open(bam_fn, "r");
-	if (bam_fn == nullptr) {
-		fprintf(stderr, "ERR: can not open BAM file %s\n", bam_fn);
+BAM_Reader::BAM_Reader(const char *fn, htsThreadPool *pool): fn(fn), pool(pool) {
+	bam_fp = sam_open(fn, "r");
+	if (bam_fp == nullptr) {
+		fprintf(stderr, "ERR: can not open BAM file %s\n", fn);
 		std::abort();
 	}
-	bam_hdr_t *bam_header = sam_hdr_read(bam_fp);
+	if (pool != nullptr and pool->pool != nullptr and hts_set_thread_pool(bam_fp, pool) != 0) {
+		fprintf(stderr, "WARN: can not decompress BAM file %s in the thread pool\n", fn);
+	}
+	bam_header = sam_hdr_read(bam_fp);
 	if (bam_header == nullptr) {
 		fprintf(stderr, "ERR: can not read header in BAM file\n");
 		std::abort();
 	}
-	hts_idx_t *bam_idx = bam_index_load(bam_fn);
+	bam_idx = bam_index_load(fn);
 	if (bam_idx == nullptr) {
 		fprintf(stderr, "ERR: can not load BAM index; use `samtools index`\n");
 		std::abort();
 	}
-	bam1_t *aln = bam_init1();
-	hts_itr_t *iter = sam_itr_querys(bam_idx, bam_header, chr_name.c_str());
+}
+
+BAM_Reader::~BAM_Reader() {
+	hts_idx_destroy(bam_idx);
+	bam_hdr_destroy(bam_header);
+	sam_close(bam_fp);
+}
+
+/** Iterator over reads overlapping SNPs [snp_l, snp_r), reads outside the SNP span are never decoded */
+static hts_itr_t *query_window(BAM_Reader &bam, const std::string &chr_name, const SNP_Column &snps,
+                               int snp_l, int snp_r) {
+	std::string region = chr_name + ':' + std::to_string(snps.pos[snp_l]) + '-' + std::to_string(snps.pos[snp_r-1]);
+	hts_itr_t *iter = sam_itr_querys(bam.bam_idx, bam.bam_header, region.c_str());
 	if (iter == nullptr) {
 		fprintf(stderr,"ERR: invalid region for chromosome %s\n", chr_name.c_str());
 		std::abort();
     }
-    Realignment realign(len, seq);
-    while(true) {
-        int got_any = sam_itr_next(bam_fp, iter, aln); // aln 是需要 align 的 read
-        if (got_any < 0) break;
-
-        int ref_start = aln->core.pos + 1; // aln->core.pos 是 0-based 左端坐标，是read在参考序列上的位置
-        int bs = binary_search_snp(snps, ref_start);
-        if (bs == -1) continue;
-
-        Read_Allele real;
-        int read_len = 0, ref_len = 0;
-        const uint32_t *cigar_array = bam_get_cigar(aln);
-        for (int i = 0; i < aln->core.n_cigar; i ++) {
-            char op_chr = bam_cigar_opchr(cigar_array[i]);  // 获取CIGAR操作符
-            int op_len = bam_cigar_oplen(cigar_array[i]);   // 获取操作长度
-            
-            // 计算读取序列长度：除了D(删除)和H(硬裁剪)外的所有操作都要计入
-            if (op_chr != 'D' && op_chr != 'H') read_len += op_len;
-            
-            // 计算参考序列长度：除了I(插入)、S(软裁剪)和H(硬裁剪)外的所有操作都要计入
-            if (op_chr != 'I' && op_chr != 'S' && op_chr != 'H') ref_len += op_len;
-        }
+	return iter;
+}
 
-        int cid = 0; // Cigar iterator
-		int que_pointer = 0, ref_pointer = ref_start; // Pointers sliding the aligned window
-		for (int i = bs; i < snps.size(); i++) {
-			auto &snp = snps[i];
-			if (snp.pos >= ref_start + ref_len) break;
-
-			// Find the cigar interval overlapping the SNP.
-			// The cigar intervals are consecutive.
-			// For example, 12D2X19=3I has cigar intervals [0,12), [12, 14), [14, 33), [33, 33).
-			// 遍历CIGAR字符串中的每个操作,直到找到包含SNP位置的区间
-			while (cid < aln->core.n_cigar) {
-				char op_chr = bam_cigar_opchr(cigar_array[cid]);  // 获取当前CIGAR操作符
-				int op_len = bam_cigar_oplen(cigar_array[cid]);   // 获取操作长度
-				
-				// 如果是硬裁剪(H),直接跳过,因为这部分序列在reads中不存在
-				if (op_chr == 'H') { cid++; continue; }
-				
-				// 如果是插入(I)或软裁剪(S),只需要更新query序列指针
-				// 因为这些操作不会影响参考序列位置
-				if (op_chr == 'I' || op_chr == 'S') {
-					que_pointer += op_len;
-					cid++;
-					continue;
-				}
-				
-				// 如果当前CIGAR区间包含SNP位置,则找到目标区间,退出循环
-				if (ref_pointer + op_len > snp.pos) break;
-				
-				// 更新参考序列指针
-				ref_pointer += op_len;
-				// 对于除删除(D)外的操作,同时更新query序列指针
-				if (op_chr != 'D') que_pointer += op_len;
-				cid++;
+/**
+ * Reference-consuming CIGAR operations of a read with their cumulative reference
+ * and query offsets, built in one walk over the numeric op codes. Insertions and
+ * clips only shift the query offsets of the following operations. Operations are
+ * contiguous on the reference, so op k covers [ref_beg[k], ref_beg[k+1]).
+ */
+struct Compiled_Cigar {
+	std::vector<int> ref_beg; /** 1-based reference start of each op, plus the end of the alignment */
+	std::vector<int> que_beg; /** Query offset at the start of each op */
+	std::vector<uint8_t> on_query; /** M/=/X consume query bases, D/N do not */
+	/**
+	 * Reference interval [clean_beg, clean_end) of the indel-free block around each M/=/X op,
+	 * i.e. the run of consecutive M/=/X ops not interrupted by I, D, N or clips
+	 */
+	std::vector<int> clean_beg, clean_end;
+
+	void compile(const bam1_t *aln) {
+		ref_beg.clear(); que_beg.clear(); on_query.clear(); clean_beg.clear(); clean_end.clear();
+		const uint32_t *cigar_array = bam_get_cigar(aln);
+		int ref_p = aln->core.pos + 1, que_p = 0;
+		int block_op = 0; // First op of the current clean block
+		for (uint32_t i = 0; i < aln->core.n_cigar; i++) {
+			const int type = bam_cigar_type(bam_cigar_op(cigar_array[i])); // bit 0: query, bit 1: reference
+			const int len = bam_cigar_oplen(cigar_array[i]);
+			if (type == 1 or type == 2) close_block(block_op, ref_p); // I/S or D/N end the block, H and P do not
+			if (type & 2) {
+				ref_beg.push_back(ref_p); que_beg.push_back(que_p); on_query.push_back(type & 1);
+				clean_beg.push_back(ref_p); clean_end.push_back(ref_p);
+				ref_p += len;
+			}
+			if (type & 1) que_p += len;
+			if (type == 1 or type == 2) block_op = ref_beg.size(); // The next block starts after this op
+		}
+		close_block(block_op, ref_p);
+		ref_beg.push_back(ref_p); // Sentinel, the merge walk never passes it
+	}
+
+	/** Set the clean interval of the match ops [block_op, ops) that end at @param ref_p */
+	void close_block(int block_op, int ref_p) {
+		const int ops = ref_beg.size();
+		if (block_op >= ops) return;
+		for (int k = block_op; k < ops; k++) { clean_beg[k] = ref_beg[block_op]; clean_end[k] = ref_p; }
+	}
+
+	/** Whether reference positions [l, r] lie in the clean block of match op @param op */
+	inline bool is_clean(int op, int l, int r) const {
+		return on_query[op] and clean_beg[op] <= l and r < clean_end[op];
+	}
+
+	/** 1-based reference position just past the alignment */
+	inline int ref_end() const { return ref_beg.back(); }
+};
+
+/** Counters of one detection run, summed over windows or pipeline workers */
+struct Detect_Stats {
+	long alleles; /** Alleles on the informative reads */
+	long filtered; /** Reads dropped by the prefilters */
+	long fast_calls; /** (read, SNP) pairs called from the aligned base */
+	long realigned; /** (read, SNP) pairs that went through realignment */
+
+	Detect_Stats(): alleles(0), filtered(0), fast_calls(0), realigned(0) {}
+
+	inline void add(const Detect_Stats &o) {
+		alleles += o.alleles; filtered += o.filtered;
+		fast_calls += o.fast_calls; realigned += o.realigned;
+	}
+};
+
+/** Base quality assumed for records without qualities */
+static const int NO_QUAL_PHRED = 10;
+
+/** Per-thread scratch for detecting alleles read by read, one per window or pipeline worker */
+class Read_Detector {
+public:
+	const SNP_Column &snps;
+	const Detect_Options &opt;
+	SNP_Cursor cursor; /** Locates the first covered SNP, reads come in coordinate order */
+	Compiled_Cigar cigar;
+	Realignment realign;
+	Read_Allele real; /** Alleles of the last informative read, marginal gaps removed */
+	std::vector<int> queued; /** Entries of real waiting for realignment */
+	std::vector<int> queued_base; /** Aligned base (nt16) of each queued entry, 15 on a deletion */
+	std::vector<uint8_t> queued_qual; /** Its base quality, the lower flanking one on a deletion, 0xff if unknown */
+	std::vector<std::pair<int, int>> dist;
+	Detect_Stats stats;
+
+	Read_Detector(const SNP_Column &snps, const Packed_Contig &ref, const Detect_Options &opt):
+		snps(snps), opt(opt), cursor(snps.pos), realign(ref, opt.overhang) {}
+
+	/**
+	 * Realign one read at every SNP it covers.
+	 * @param snp_l and @param snp_r only reads whose first covered SNP lies in [snp_l, snp_r) are processed
+	 * @return whether the read is informative, i.e. carries at least two alleles
+	 */
+	bool detect(const bam1_t *aln, int snp_l, int snp_r);
+
+	/**
+	 * Allele and weight of a realigned call from the REF/ALT edit distances @param dist.
+	 * Every extra edit against an allele is taken as a sequencing error at the SNP base,
+	 * so the log-likelihood ratio is the distance difference times the base quality.
+	 * Ties fall back to the aligned @param base (nt16) with the smallest weight.
+	 */
+	void score_llr(Allele_Call &call, const std::pair<int, int> &dist, int base, uint8_t base_qual) const;
+};
+
+void Read_Detector::score_llr(Allele_Call &call, const std::pair<int, int> &dist, int base, uint8_t base_qual) const {
+	const int q = base_qual == 0xff ? NO_QUAL_PHRED : std::max<int>(base_qual, 1);
+	const int diff = dist.second - dist.first; // > 0 favours REF
+	if (diff != 0) {
+		call.allele = diff > 0 ? 0 : 1;
+		call.qual = std::min(std::abs(diff) * q, (int)Allele_Call::MAX_QUAL);
+	} else if (base == seq_nt16_table[(uint8_t)snps.ref[call.snp_idx]]) {
+		call.allele = 0; call.qual = 1;
+	} else if (base == seq_nt16_table[(uint8_t)snps.alt[call.snp_idx]]) {
+		call.allele = 1; call.qual = 1;
+	} else {
+		call.allele = -1; call.qual = 0;
+	}
+}
+
+bool Read_Detector::detect(const bam1_t *aln, int snp_l, int snp_r) {
+	real.clear();
+	int ref_start = aln->core.pos + 1; // aln->core.pos 是 0-based 左端坐标，是read在参考序列上的位置
+	int bs = cursor.seek(ref_start);
+	if (bs == -1) return false;
+	if (bs < snp_l or bs >= snp_r) return false; // Owned by another window
+
+	// Prefilters, each window counts only the reads it owns
+	if ((aln->core.flag & opt.exclude_flags) or aln->core.qual < opt.min_mapq) { stats.filtered++; return false; }
+	if (aln->core.l_qseq <= 0) { stats.filtered++; return false; } // SEQ 为 *, 没有碱基可比对
+	cigar.compile(aln);
+	if (cigar.ref_end() - ref_start < opt.min_aligned_len) { stats.filtered++; return false; }
+	if (opt.min_snps > 1) {
+		auto first = snps.pos.begin() + bs;
+		if (std::lower_bound(first, snps.pos.end(), cigar.ref_end()) - first < opt.min_snps) { stats.filtered++; return false; }
+	}
+
+	int op = 0; // Operation of the merge walk, only moves forward as SNPs are sorted
+	const uint8_t *seq = bam_get_seq(aln), *qual = bam_get_qual(aln);
+	queued.clear(); queued_base.clear(); queued_qual.clear();
+	for (int i = bs; i < snps.size(); i++) {
+		const int snp_pos = snps.pos[i];
+		if (snp_pos >= cigar.ref_end()) break;
+
+		// 找到包含SNP位置的操作; 删除(D/N)上的SNP取其前一个query碱基
+		while (cigar.ref_beg[op+1] <= snp_pos) op++;
+		int que_pos = cigar.on_query[op] ? cigar.que_beg[op] + snp_pos - cigar.ref_beg[op] : cigar.que_beg[op] - 1;
+
+		// Fast path: no indel within the overhang and a confident base, the aligned base is the allele.
+		// qual is 0xff when the record has no qualities, which never passes.
+		if (cigar.is_clean(op, snp_pos - opt.overhang, snp_pos + opt.overhang) and qual[que_pos] >= opt.fast_min_baseq
+		    and qual[que_pos] != 0xff) {
+			const int base = bam_seqi(seq, que_pos);
+			const int allele = base == seq_nt16_table[(uint8_t)snps.ref[i]] ? 0
+			                 : base == seq_nt16_table[(uint8_t)snps.alt[i]] ? 1 : -2;
+			if (allele >= 0) {
+				// One substitution separates the two alleles, so the ratio is the base quality itself
+				real.emplace_back(Allele_Call(que_pos, i, allele, opt.allele_llr ? std::min((int)qual[que_pos], (int)Allele_Call::MAX_QUAL) : 1));
+				stats.fast_calls++;
+				continue;
 			}
+		}
 
-			char op_chr = bam_cigar_opchr(cigar_array[cid]);
-			int que_pos = op_chr == 'D' ?que_pointer - 1 : que_pointer + snp.pos - ref_pointer;
-			auto pair = realign.bit_vector_dp(aln, que_pos, snp.pos - 1, snp.alt); // realign.bit_vector_dp 会进行realignment，返回的是两个编辑距离，分别是ref和alt
-			realign.show_alignment(aln, seq, snp.pos);
-
-            exit(0);
-            int allele;
-			if (pair.first < pair.second) allele = 0; // ref 的编辑距离小于 alt 的编辑距离，则认为 ref 是正确的
-			else if (pair.first > pair.second) allele = 1; // alt 的编辑距离小于 ref 的编辑距离，则认为 alt 是正确的
-			else allele = -1; // 编辑距离相同，则认为无法确定
-			real.emplace_back(Allele_Call(que_pos, i, allele)); // 记录下当前的 SNP 和 allele
-
-            // Remove marginal gaps
-		int l_active = -1, r_active = -2;
-		for (int i = 0; i < real.size(); i++) { // 遍历所有 SNP 和 allele
-			const auto &v = real[i];
-			if (v.allele == -1) continue; // 如果 allele 无法确定，则跳过
-			if (l_active == -1) l_active = i; // 记录下第一个有效的 SNP
-			r_active = i; // 记录下最后一个有效的 SNP
+		if (queued.empty()) realign.load_read(aln); // Decode the read once for all its realigned SNPs
+		realign.add_site(que_pos, snp_pos - 1, snps.alt[i]); // 先收集所有 SNP, 再一起 realignment
+		queued.push_back(real.size());
+		queued_base.push_back(cigar.on_query[op] ? bam_seqi(seq, que_pos) : 15);
+		if (cigar.on_query[op]) queued_qual.push_back(qual[que_pos]);
+		else { // 删除上没有碱基, 取两侧碱基质量的较小值
+			const int next = cigar.que_beg[op];
+			uint8_t q = 0xff;
+			if (que_pos >= 0) q = qual[que_pos];
+			if (next < aln->core.l_qseq) q = std::min(q, qual[next]);
+			queued_qual.push_back(q);
 		}
-		if (l_active == -1) continue;
-		Read_Allele no_gap_real;
-		for (int i = l_active; i <= r_active; i++) no_gap_real.push_back(real[i]);
-		real = no_gap_real;
-
-		// Only push back informative reads
-		if (real.size() >= 2) { // 如果 read 包含两个或以上的 SNP，则认为是有信息的
-			total_allele += real.size();
-			for (const auto &v : real) snps[v.snp_idx].add_read(ret.size(), v.allele);
-			ret.push_back(real);
+		real.emplace_back(Allele_Call(que_pos, i, -1)); // 记录下当前的 SNP, allele 稍后填入
+	}
+
+	// Realign the remaining SNPs of the read in one batch, each pair is the edit distance with ref and alt
+	if (not queued.empty()) {
+		realign.realign_batch(dist);
+		stats.realigned += queued.size();
+	}
+	for (int k = 0; k < queued.size(); k++) {
+		const auto &pair = dist[k];
+		auto &call = real[queued[k]];
+		if (opt.allele_llr) {
+			score_llr(call, pair, queued_base[k], queued_qual[k]);
+			continue;
 		}
-        }
+		if (pair.first < pair.second) call.allele = 0; // ref 的编辑距离小于 alt 的编辑距离，则认为 ref 是正确的
+		else if (pair.first > pair.second) call.allele = 1; // alt 的编辑距离小于 ref 的编辑距离，则认为 alt 是正确的
+		else call.allele = -1; // 编辑距离相同，则认为无法确定
+	}
 
+	// Remove marginal gaps
+	int l_active = -1, r_active = -2;
+	for (int i = 0; i < real.size(); i++) { // 遍历所有 SNP 和 allele
+		const auto &v = real[i];
+		if (v.allele == -1) continue; // 如果 allele 无法确定，则跳过
+		if (l_active == -1) l_active = i; // 记录下第一个有效的 SNP
+		r_active = i; // 记录下最后一个有效的 SNP
+	}
+	if (l_active == -1) return false;
+	real.erase(real.begin() + r_active + 1, real.end());
+	real.erase(real.begin(), real.begin() + l_active);
+
+	// Only push back informative reads
+	if (real.size() < 2) return false; // 如果 read 包含两个或以上的 SNP，则认为是有信息的
+	stats.alleles += real.size();
+	return true;
+}
+
+/**
+ * Detect alleles of reads whose first covered SNP lies in [snp_l, snp_r).
+ * Neighbouring windows query overlapping reads, the ownership rule makes sure
+ * every read is processed by exactly one window.
+ * @param rows informative reads are appended here
+ */
+static Detect_Stats detect_window(BAM_Reader &bam, const std::string &chr_name, const SNP_Column &snps,
+                                  int snp_l, int snp_r, const Packed_Contig &ref, const Detect_Options &opt,
+                                  Fragment_Matrix &rows) {
+	hts_itr_t *iter = query_window(bam, chr_name, snps, snp_l, snp_r);
+	bam1_t *aln = bam_init1();
+	Read_Detector detector(snps, ref, opt);
+    while(sam_itr_next(bam.bam_fp, iter, aln) >= 0) { // aln 是需要 align 的 read
+		if (detector.detect(aln, snp_l, snp_r)) rows.add_row(detector.real);
     }
 
+	hts_itr_destroy(iter);
     bam_destroy1(aln);
-	bam_hdr_destroy(bam_header);
-	sam_close(bam_fp);
-	fprintf(stderr, "Detected %d alleles on %ld informative reads\n", total_allele, ret.size());
+	return detector.stats;
+}
+
+/** A batch of reads travelling through the detection pipeline */
+struct Read_Batch {
+	static const int MAX_READS = 256;
+	int id; /** Order of the batch in the BAM file */
+	int n; /** Number of reads filled */
+	bam1_t *reads[MAX_READS];
+	Fragment_Matrix rows; /** Informative reads of the batch */
+
+	Read_Batch(): id(0), n(0) {
+		for (auto &aln : reads) aln = bam_init1();
+	}
+	~Read_Batch() {
+		for (auto &aln : reads) bam_destroy1(aln);
+	}
+};
+
+/**
+ * Detect alleles in a reader -> realignment workers -> collector pipeline.
+ * The reader thread decodes batches of records, the workers realign them with
+ * their own Realignment, and the calling thread collects finished batches in
+ * file order. A fixed set of batches is recycled, which bounds the memory and
+ * blocks the reader when the workers fall behind.
+ */
+static Detect_Stats detect_pipeline(BAM_Reader &bam, const std::string &chr_name, const SNP_Column &snps,
+                           const Packed_Contig &ref, const Detect_Options &opt, Fragment_Matrix &rows) {
+	const int threads = opt.threads;
+	const int batch_n = threads * 2 + 2;
+	std::vector<std::unique_ptr<Read_Batch>> batches(batch_n);
+	Bounded_Queue<Read_Batch *> free_q(batch_n), work_q(batch_n), done_q(batch_n);
+	for (auto &batch : batches) {
+		batch.reset(new Read_Batch());
+		free_q.push(batch.get());
+	}
+
+	hts_itr_t *iter = query_window(bam, chr_name, snps, 0, snps.size());
+	std::thread reader([&]() {
+		Read_Batch *batch; int id = 0;
+		bool more = true;
+		while (more and free_q.pop(batch)) {
+			batch->id = id++;
+			batch->n = 0;
+			while (batch->n < Read_Batch::MAX_READS) {
+				if (sam_itr_next(bam.bam_fp, iter, batch->reads[batch->n]) < 0) { more = false; break; }
+				batch->n++;
+			}
+			work_q.push(batch);
+		}
+		work_q.close();
+	});
+
+	std::atomic<int> running(threads);
+	std::vector<std::thread> workers;
+	std::vector<Detect_Stats> worker_stats(threads);
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&, t]() {
+			Read_Detector detector(snps, ref, opt);
+			Read_Batch *batch;
+			while (work_q.pop(batch)) {
+				batch->rows.clear();
+				for (int i = 0; i < batch->n; i++) {
+					if (detector.detect(batch->reads[i], 0, snps.size())) batch->rows.add_row(detector.real);
+				}
+				done_q.push(batch);
+			}
+			worker_stats[t] = detector.stats;
+			if (--running == 0) done_q.close();
+		});
+	}
+
+	// Collector: emit batches in file order so that read ids are stable
+	int next_id = 0;
+	std::map<int, Read_Batch *> pending;
+	Read_Batch *batch;
+	while (done_q.pop(batch)) {
+		pending[batch->id] = batch;
+		for (auto it = pending.begin(); it != pending.end() and it->first == next_id; it = pending.erase(it)) {
+			rows.append(it->second->rows);
+			free_q.push(it->second);
+			next_id++;
+		}
+	}
+	free_q.close();
+
+	reader.join();
+	for (auto &th : workers) th.join();
+	hts_itr_destroy(iter);
+
+	Detect_Stats stats;
+	for (const auto &w : worker_stats) stats.add(w);
+	return stats;
+}
+
+Fragment_Matrix detect_allele(BAM_Reader &bam, const std::string &chr_name,
+                              const SNP_Column &snps, const Packed_Contig &ref, const Detect_Options &opt) {
+	Fragment_Matrix ret; Detect_Stats stats;
+	if (snps.empty()) return ret;
+	const int threads = opt.threads;
+
+	if (opt.pipeline and threads > 1) {
+		stats = detect_pipeline(bam, chr_name, snps, ref, opt, ret);
+	} else {
+		// Split the chromosome at group chunk boundaries, a few windows per thread for load balance
+		const int chunk_n = ((int)snps.size() + Group::MAX_CHUNK_VARIANTS - 1) / Group::MAX_CHUNK_VARIANTS;
+		const int window_n = threads > 1 ? std::min(chunk_n, threads * 4) : 1;
+		std::vector<int> bounds(window_n + 1);
+		for (int w = 0; w <= window_n; w++) {
+			bounds[w] = std::min((int)snps.size(), (int)((long)chunk_n * w / window_n) * Group::MAX_CHUNK_VARIANTS);
+		}
+
+		std::vector<Fragment_Matrix> window_rows(window_n);
+		std::vector<Detect_Stats> window_stats(window_n);
+		std::vector<std::unique_ptr<BAM_Reader>> readers(threads);
+		parallel_for(window_n, threads, [&](int w, int tid) {
+			if (tid > 0 and readers[tid] == nullptr) readers[tid].reset(new BAM_Reader(bam.fn.c_str(), bam.pool));
+			BAM_Reader &reader = tid == 0 ?bam :*readers[tid];
+			window_stats[w] = detect_window(reader, chr_name, snps, bounds[w], bounds[w+1], ref, opt,
+			                                window_rows[w]);
+		});
+
+		// Merge windows in genomic order, so read ids do not depend on the number of threads
+		if (window_n == 1) {
+			ret = std::move(window_rows[0]);
+		} else {
+			int row_n = 0; size_t entry_n = 0;
+			for (const auto &rows : window_rows) { row_n += rows.rows(); entry_n += rows.entries(); }
+			ret.reserve(row_n, entry_n); // Allocated once for all windows
+			for (const auto &rows : window_rows) ret.append(rows);
+		}
+		for (const auto &w : window_stats) stats.add(w);
+	}
+
+	// Read ids are the row indices
+	ret.transpose(snps.size());
+
+	fprintf(stderr, "Detected %ld alleles on %d informative reads\n", stats.alleles, ret.rows());
+	fprintf(stderr, "    Skipped %ld reads by MAPQ, flag, missing SEQ, length or SNP filters\n", stats.filtered);
+	const long calls = stats.fast_calls + stats.realigned;
+	fprintf(stderr, "    Fast path called %ld of %ld alleles without realignment (%.1f%%)\n", stats.fast_calls, calls,
+	        calls > 0 ? 100.0 * stats.fast_calls / calls : 0.0);
 	fprintf(stderr, "    Decompress BAM costs x CPU and x real seconds\n");
 	fprintf(stderr, "    Realignment costs x CPU and x real seconds\n");
 	return ret;
-}
\ No newline at end of file
+}
@@ -0,0 +1,58 @@
+#include "fragment.h"
+
+void Fragment_Matrix::reserve(int row_n, size_t entry_n) {
+	row_beg.reserve(row_n + 1);
+	snp_idx.reserve(entry_n);
+	que_pos.reserve(entry_n);
+	allele.reserve(entry_n);
+	qual.reserve(entry_n);
+}
+
+void Fragment_Matrix::clear() {
+	row_beg.assign(1, 0);
+	snp_idx.clear(); que_pos.clear(); allele.clear(); qual.clear();
+	col_beg.clear(); col_rid.clear(); col_allele.clear(); col_qual.clear();
+}
+
+void Fragment_Matrix::add_row(const Read_Allele &real) {
+	for (const auto &v : real) {
+		snp_idx.push_back(v.snp_idx);
+		que_pos.push_back(v.que_pos);
+		allele.push_back(v.allele);
+		qual.push_back(v.qual);
+	}
+	row_beg.push_back(snp_idx.size());
+}
+
+void Fragment_Matrix::append(const Fragment_Matrix &o) {
+	const uint32_t base = entries();
+	for (int r = 1; r <= o.rows(); r++) row_beg.push_back(base + o.row_beg[r]);
+	snp_idx.insert(snp_idx.end(), o.snp_idx.begin(), o.snp_idx.end());
+	que_pos.insert(que_pos.end(), o.que_pos.begin(), o.que_pos.end());
+	allele.insert(allele.end(), o.allele.begin(), o.allele.end());
+	qual.insert(qual.end(), o.qual.begin(), o.qual.end());
+}
+
+void Fragment_Matrix::transpose(int snp_n) {
+	// Count entries per SNP, prefix sum, then fill; rows are visited in order so reads stay sorted on each SNP
+	col_beg.assign(snp_n + 1, 0);
+	for (auto s : snp_idx) col_beg[s + 1]++;
+	for (int i = 0; i < snp_n; i++) col_beg[i+1] += col_beg[i];
+	col_rid.resize(entries());
+	col_allele.resize(entries());
+	col_qual.resize(entries());
+	std::vector<uint32_t> fill(col_beg.begin(), col_beg.end() - 1);
+	for (int r = 0; r < rows(); r++) {
+		for (uint32_t k = row_beg[r]; k < row_beg[r+1]; k++) {
+			uint32_t j = fill[snp_idx[k]]++;
+			col_rid[j] = r;
+			col_allele[j] = allele[k];
+			col_qual[j] = qual[k];
+		}
+	}
+}
+
+size_t Fragment_Matrix::memory() const {
+	return (row_beg.capacity() + snp_idx.capacity() + que_pos.capacity() + col_beg.capacity() + col_rid.capacity())
+	       * sizeof(uint32_t) + allele.capacity() + col_allele.capacity() + qual.capacity() + col_qual.capacity();
+}
@@ -1,18 +1,54 @@
+#include <algorithm>
+
 #include "group.h"
 
-Groups group_snps(const std::vector<SNP> &snps) {
+Disjoint_Set::Disjoint_Set(int n): parent(n) {
+    for (int i = 0; i < n; i++) parent[i] = i;
+}
+
+int Disjoint_Set::find(int x) {
+    int root = x;
+    while (parent[root] != root) root = parent[root];
+    while (parent[x] != root) { int next = parent[x]; parent[x] = root; x = next; }
+    return root;
+}
+
+void Disjoint_Set::unite(int a, int b) {
+    a = find(a); b = find(b);
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+}
+
+std::vector<int> find_phase_blocks(const Fragment_Matrix &frags, int snp_n) {
+    Disjoint_Set sets(snp_n);
+    for (int r = 0; r < frags.rows(); r++) {
+        int first = -1;
+        for (uint32_t k = frags.row_beg[r]; k < frags.row_beg[r+1]; k++) {
+            if (frags.allele[k] < 0) continue; // gap 不提供连接
+            if (first < 0) first = frags.snp_idx[k];
+            else sets.unite(first, frags.snp_idx[k]);
+        }
+    }
+    std::vector<int> block(snp_n);
+    for (int i = 0; i < snp_n; i++) block[i] = sets.find(i);
+    return block;
+}
+
+Groups group_snps(const SNP_Column &snps, const std::vector<int> &blocks) {
     Groups groups;
     const auto chunkL = Group::MAX_CHUNK_LENGTH;
     const auto chunkV = Group::MAX_CHUNK_VARIANTS;
 
-    int i = 0;
-    while (i < snps.size()) {
-        Group group;
-        for (int j = 0; j < chunkV && i + j < snps.size(); j++) {
-            group.snp_list.push_back(snps[i + j]);
-        }
-        groups.push_back(group);
-        i += chunkV;
+    // last[b]: last SNP of block b; a boundary is a gap when no block before it reaches past it
+    std::vector<int> last(snps.size());
+    for (int i = 0; i < snps.size(); i++) last[blocks[i]] = i;
+
+    int beg = 0, reach = 0;
+    for (int i = 1; i <= snps.size(); i++) {
+        reach = std::max(reach, last[blocks[i-1]]);
+        if (i < snps.size() and i - beg < chunkV and snps.pos[i] - snps.pos[beg] < chunkL and reach >= i) continue;
+        groups.emplace_back(snps, beg, i);
+        beg = i;
     }
+    return groups;
 }
-
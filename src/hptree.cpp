@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "hptree.h"
+
+HPTree::HPTree(const Fragment_Matrix &frags): frags(frags), slot_n(0) {
+	slot.assign(frags.rows(), -1);
+}
+
+int HPTree::last_snp_in(int read, int end) const {
+	// Entries of a row are sorted by SNP, take the last one before end
+	auto first = frags.snp_idx.begin() + frags.row_beg[read], last = frags.snp_idx.begin() + frags.row_beg[read+1];
+	return *(std::lower_bound(first, last, (uint32_t)end) - 1);
+}
+
+long HPTree::phase(int beg, int end, std::vector<int8_t> &hap) {
+	hap.assign(end - beg, -1);
+	pool.clear();
+	pool.reserve((size_t)(end - beg) * MAX_PATH * 2 + 1);
+	paths.assign(1, Path{-1, 0});
+	counters.assign(1, std::vector<int>());
+	free_slots.clear(); slot_n = 0;
+	std::vector<int> retire; // Reads leaving after the current SNP
+	std::vector<std::pair<long, int>> cand; // (score, parent * 2 + allele) of every extension
+	bool first = true;
+
+	for (int i = beg; i < end; i++) {
+		const uint32_t cb = frags.col_beg[i], ce = frags.col_beg[i+1];
+		bool covered = false;
+		for (uint32_t k = cb; k < ce; k++) covered |= frags.col_allele[k] >= 0;
+		retire.clear();
+		if (not covered) { // Nothing to decide, the SNP stays unphased
+			for (uint32_t k = cb; k < ce; k++) {
+				const int r = frags.col_rid[k];
+				if (slot[r] >= 0 and last_snp_in(r, end) == i) { free_slots.push_back(slot[r]); slot[r] = -1; }
+			}
+			continue;
+		}
+
+		// Reads reaching their first SNP of the range take a slot on every path
+		for (uint32_t k = cb; k < ce; k++) {
+			const int r = frags.col_rid[k];
+			if (slot[r] < 0) {
+				if (free_slots.empty()) {
+					free_slots.push_back(slot_n++);
+					for (auto &c : counters) c.resize(slot_n * 2, 0);
+				}
+				slot[r] = free_slots.back(); free_slots.pop_back();
+				for (auto &c : counters) c[slot[r] * 2] = c[slot[r] * 2 + 1] = 0;
+			}
+			if (last_snp_in(r, end) == i) retire.push_back(r);
+		}
+
+		// Score both extensions of every path; the first SNP is fixed to REF on haplotype 1
+		cand.clear();
+		for (int p = 0; p < paths.size(); p++) {
+			const auto &c = counters[p];
+			for (int h = 0; h < (first ? 1 : 2); h++) {
+				long score = paths[p].score;
+				for (uint32_t k = cb; k < ce; k++) {
+					const int a = frags.col_allele[k];
+					if (a < 0) continue;
+					const int s = slot[frags.col_rid[k]] * 2, w = frags.col_qual[k];
+					const int c0 = c[s] + (a != h ? w : 0), c1 = c[s+1] + (a == h ? w : 0);
+					score += std::min(c0, c1) - std::min(c[s], c[s+1]);
+				}
+				cand.emplace_back(score, p * 2 + h);
+			}
+		}
+		// Keep the best MAX_PATH, ties broken by the order of creation so the result is deterministic
+		const int keep = std::min((int)cand.size(), (int)MAX_PATH);
+		std::partial_sort(cand.begin(), cand.begin() + keep, cand.end());
+
+		next_paths.clear();
+		next_counters.resize(keep);
+		for (int n = 0; n < keep; n++) {
+			const int p = cand[n].second / 2, h = cand[n].second % 2;
+			pool.push_back(Node{paths[p].node, i, (int8_t)h});
+			next_paths.push_back(Path{(int)pool.size() - 1, cand[n].first});
+			auto &c = next_counters[n];
+			c = counters[p];
+			for (uint32_t k = cb; k < ce; k++) {
+				const int a = frags.col_allele[k];
+				if (a < 0) continue;
+				const int s = slot[frags.col_rid[k]] * 2, w = frags.col_qual[k];
+				c[s + (a == h ? 1 : 0)] += w;
+			}
+		}
+		paths.swap(next_paths);
+		counters.swap(next_counters);
+		first = false;
+
+		for (int r : retire) { free_slots.push_back(slot[r]); slot[r] = -1; }
+	}
+
+	// Reset reads of the range for the next call
+	for (int i = beg; i < end; i++) {
+		for (uint32_t k = frags.col_beg[i]; k < frags.col_beg[i+1]; k++) slot[frags.col_rid[k]] = -1;
+	}
+
+	// Backtrack the best path, paths are sorted by score
+	for (int n = paths[0].node; n >= 0; n = pool[n].parent) hap[pool[n].snp - beg] = pool[n].hap;
+	return paths[0].score;
+}
+
+/** Weighted agreement of an allele with haplotype 1, 0 for unphased SNPs */
+static inline long agreement(int allele, int hap, int w) {
+	return hap < 0 or allele < 0 ? 0 : (allele == hap ? w : -w);
+}
+
+long stitch_vote(const Fragment_Matrix &frags, int l_beg, int l_end, const int8_t *l_hap,
+                 int r_beg, int r_end, const int8_t *r_hap) {
+	// Agreement of every read with the right range, gathered by column and summed per read
+	std::vector<std::pair<uint32_t, long>> right;
+	for (int i = r_beg; i < r_end; i++) {
+		for (uint32_t k = frags.col_beg[i]; k < frags.col_beg[i+1]; k++) {
+			long s = agreement(frags.col_allele[k], r_hap[i - r_beg], frags.col_qual[k]);
+			if (s != 0) right.emplace_back(frags.col_rid[k], s);
+		}
+	}
+	std::sort(right.begin(), right.end());
+
+	long vote = 0;
+	for (size_t j = 0; j < right.size(); ) {
+		const uint32_t r = right[j].first;
+		long sr = 0;
+		for (; j < right.size() and right[j].first == r; j++) sr += right[j].second;
+
+		long sl = 0;
+		auto first = frags.snp_idx.begin() + frags.row_beg[r], last = frags.snp_idx.begin() + frags.row_beg[r+1];
+		for (auto it = std::lower_bound(first, last, (uint32_t)l_beg); it != last and *it < l_end; it++) {
+			const size_t k = it - frags.snp_idx.begin();
+			sl += agreement(frags.allele[k], l_hap[*it - l_beg], frags.qual[k]);
+		}
+		if (sl == 0 or sr == 0) continue;
+		vote += ((sl > 0) == (sr > 0) ? 1 : -1) * std::min(std::abs(sl), std::abs(sr));
+	}
+	return vote;
+}
@@ -0,0 +1,141 @@
+#include <algorithm>
+
+#include "mec_solver.h"
+
+MEC_Solver::MEC_Solver(const Fragment_Matrix &frags, int max_coverage): frags(frags), max_coverage(max_coverage) {
+	slot.assign(frags.rows(), -1);
+}
+
+void MEC_Solver::downsample(int beg, int end, std::vector<Read_Span> &reads) {
+	std::vector<uint32_t> rids;
+	for (int i = beg; i < end; i++) {
+		for (uint32_t k = frags.col_beg[i]; k < frags.col_beg[i+1]; k++) {
+			if (frags.col_allele[k] >= 0) rids.push_back(frags.col_rid[k]);
+		}
+	}
+	std::sort(rids.begin(), rids.end());
+	rids.erase(std::unique(rids.begin(), rids.end()), rids.end());
+
+	std::vector<Read_Span> all;
+	for (uint32_t r : rids) {
+		Read_Span span{r, -1, -1, 0};
+		auto first = frags.snp_idx.begin() + frags.row_beg[r], last = frags.snp_idx.begin() + frags.row_beg[r+1];
+		for (auto it = std::lower_bound(first, last, (uint32_t)beg); it != last and *it < end; it++) {
+			if (frags.allele[it - frags.snp_idx.begin()] < 0) continue;
+			if (span.first < 0) span.first = *it;
+			span.last = *it; span.calls++;
+		}
+		if (span.calls >= 2) all.push_back(span); // 单个 allele 的 read 总能放到不冲突的一侧
+	}
+	// Reads with more alleles first, then by position so the choice does not depend on threads
+	std::sort(all.begin(), all.end(), [](const Read_Span &a, const Read_Span &b) {
+		return a.calls != b.calls ? a.calls > b.calls : a.first != b.first ? a.first < b.first : a.rid < b.rid;
+	});
+
+	std::vector<int> cov(end - beg, 0);
+	reads.clear();
+	for (const auto &span : all) {
+		auto l = cov.begin() + (span.first - beg), r = cov.begin() + (span.last - beg) + 1;
+		if (*std::max_element(l, r) >= max_coverage) continue;
+		for (auto it = l; it != r; it++) (*it)++;
+		reads.push_back(span);
+	}
+	std::sort(reads.begin(), reads.end(), [](const Read_Span &a, const Read_Span &b) {
+		return a.first != b.first ? a.first < b.first : a.rid < b.rid;
+	});
+}
+
+long MEC_Solver::phase(int beg, int end, std::vector<int8_t> &hap, std::vector<int> &cuts) {
+	hap.assign(end - beg, -1);
+	cuts.clear();
+	std::vector<Read_Span> reads;
+	downsample(beg, end, reads);
+	if (reads.empty()) return 0;
+
+	// Give every read the lowest free bit from its first to its last SNP. keep[j] holds the
+	// bits of reads that were active before column j and are still active on it
+	std::vector<int> cols, keep, leave; // leave[j]: bits freed after column j
+	std::vector<char> active(end - beg, 0);
+	std::vector<int> by_last(reads.size());
+	for (int n = 0; n < reads.size(); n++) {
+		by_last[n] = n;
+		auto first = frags.snp_idx.begin() + frags.row_beg[reads[n].rid], last = frags.snp_idx.begin() + frags.row_beg[reads[n].rid+1];
+		for (auto it = std::lower_bound(first, last, (uint32_t)beg); it != last and *it < end; it++) {
+			if (frags.allele[it - frags.snp_idx.begin()] >= 0) active[*it - beg] = 1;
+		}
+	}
+	std::stable_sort(by_last.begin(), by_last.end(), [&](int a, int b) { return reads[a].last < reads[b].last; });
+
+	int used = 0, bits = 0; // Bits in use and the number of bits ever used
+	size_t in = 0, out = 0;
+	for (int i = beg; i < end; i++) {
+		if (not active[i - beg]) continue;
+		if (not cols.empty() and used == 0) cuts.push_back(i); // 没有保留的 read 跨过这里
+		cols.push_back(i);
+		keep.push_back(used);
+		for (; in < reads.size() and reads[in].first == i; in++) {
+			int b = 0;
+			while (used >> b & 1) b++;
+			used |= 1 << b; bits = std::max(bits, b + 1);
+			slot[reads[in].rid] = b;
+		}
+		int freed = 0;
+		for (; out < by_last.size() and reads[by_last[out]].last == i; out++) freed |= 1 << slot[reads[by_last[out]].rid];
+		used &= ~freed;
+		leave.push_back(freed);
+	}
+
+	// Bits of inactive reads are kept as don't-care: both values of the bit hold the same cost
+	const int size = 1 << bits;
+	table.assign(cols.size() * size, 0);
+	std::vector<int> cur(size, 0), delta(bits), c0(size);
+	auto column_cost = [&](int i, int &total) {
+		// c0[m]: conflicts when haplotype 1 carries REF, reads with bit 0 are on haplotype 1
+		int base = 0; total = 0;
+		std::fill(delta.begin(), delta.end(), 0);
+		for (uint32_t k = frags.col_beg[i]; k < frags.col_beg[i+1]; k++) {
+			const int s = slot[frags.col_rid[k]], a = frags.col_allele[k], w = frags.col_qual[k];
+			if (s < 0 or a < 0) continue;
+			total += w;
+			if (a == 1) { base += w; delta[s] -= w; } else delta[s] += w;
+		}
+		c0[0] = base;
+		for (int m = 1; m < size; m++) c0[m] = c0[m & (m - 1)] + delta[__builtin_ctz(m)];
+	};
+
+	for (int j = 0; j < cols.size(); j++) {
+		int total;
+		column_cost(cols[j], total);
+		int *row = table.data() + (size_t)j * size;
+		for (int m = 0; m < size; m++) row[m] = cur[m] + std::min(c0[m], total - c0[m]);
+		std::copy(row, row + size, cur.begin());
+		for (int b = 0; b < bits; b++) {
+			if (not (leave[j] >> b & 1)) continue;
+			for (int m = 0; m < size; m++) {
+				if (m >> b & 1) continue;
+				cur[m] = cur[m | 1 << b] = std::min(cur[m], cur[m | 1 << b]);
+			}
+		}
+	}
+
+	// Backtrack from the best bipartition, the smallest mask wins ties
+	const int last = cols.size() - 1;
+	const int *row = table.data() + (size_t)last * size;
+	int mask = std::min_element(row, row + size) - row;
+	const long score = row[mask];
+	for (int j = last; j >= 0; j--) {
+		int total;
+		column_cost(cols[j], total);
+		hap[cols[j] - beg] = c0[mask] <= total - c0[mask] ? 0 : 1;
+		if (j == 0) break;
+		const int *prev = table.data() + (size_t)(j - 1) * size, shared = keep[j];
+		int best = -1;
+		for (int m = 0; m < size; m++) {
+			if ((m & shared) == (mask & shared) and (best < 0 or prev[m] < prev[best])) best = m;
+		}
+		mask = best;
+	}
+
+	for (const auto &span : reads) slot[span.rid] = -1;
+	return score;
+}
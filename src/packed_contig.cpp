@@ -0,0 +1,55 @@
+#include <algorithm>
+
+#include "packed_contig.h"
+
+/** Append position i to the run list, merging with the last run when adjacent */
+static inline void extend_runs(std::vector<Packed_Contig::Run> &runs, int i) {
+	if (not runs.empty() and runs.back().second == i) runs.back().second++;
+	else runs.emplace_back(i, i + 1);
+}
+
+Packed_Contig::Packed_Contig(const char *seq, int len, int offset) {
+	pack(seq, 0, len, std::max(len, 1), std::max(len, 1));
+	this->offset = offset;
+}
+
+Packed_Contig::Packed_Contig(const char *text, int beg, int end, int line_bases, int line_width) {
+	pack(text, beg, end, line_bases, line_width);
+}
+
+void Packed_Contig::pack(const char *text, int beg, int end, int line_bases, int line_width) {
+	offset = beg; length = end - beg;
+	bases.assign(length / 32 + 1, 0ull);
+	n_runs.clear();
+	for (int p = beg; p < end; ) {
+		// One line at a time, the first one may start in the middle
+		int col = p % line_bases, n = std::min(line_bases - col, end - p);
+		const char *seq = text + (long)(p / line_bases) * line_width + col;
+		for (int k = 0; k < n; k++) {
+			int i = p - beg + k;
+			uint64_t code;
+			switch (seq[k]) {
+				case 'A': case 'a': code = 0; break;
+				case 'C': case 'c': code = 1; break;
+				case 'G': case 'g': code = 2; break;
+				case 'T': case 't': code = 3; break;
+				default: code = 0; extend_runs(n_runs, i); break; // Stored as A, overridden by n_runs
+			}
+			bases[i / 32] |= code << (2 * (i % 32));
+		}
+		p += n;
+	}
+}
+
+void Packed_Contig::decode(int beg, int n, uint8_t *codes) const {
+	for (int i = 0; i < n; i++) {
+		int p = beg + i;
+		codes[i] = (uint8_t)((bases[p / 32] >> (2 * (p % 32))) & 3u);
+	}
+	// Overlay runs of N overlapping [beg, beg+n)
+	auto it = std::upper_bound(n_runs.begin(), n_runs.end(), Run(beg, INT32_MAX));
+	if (it != n_runs.begin()) --it;
+	for (; it != n_runs.end() and it->first < beg + n; ++it) {
+		for (int p = std::max(it->first, beg); p < std::min(it->second, beg + n); p++) codes[p - beg] = 4;
+	}
+}
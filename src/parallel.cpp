@@ -0,0 +1,23 @@
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include "parallel.h"
+
+void parallel_for(int n, int threads, const std::function<void(int, int)> &job) {
+	threads = std::max(1, std::min(threads, n));
+	if (threads == 1) { // Run on the calling thread, no pool overhead
+		for (int i = 0; i < n; i++) job(i, 0);
+		return;
+	}
+
+	std::atomic<int> next(0);
+	auto worker = [&](int tid) {
+		for (int i = next++; i < n; i = next++) job(i, tid);
+	};
+	std::vector<std::thread> pool;
+	for (int t = 1; t < threads; t++) pool.emplace_back(worker, t);
+	worker(0);
+	for (auto &th : pool) th.join();
+}
@@ -6,90 +6,140 @@
 
 #include "realignment.h"
 
-Realignment::Realignment(int l, const char *r) :gr_len(l), global_ref(r) {
-	q_len = r_len = 0;
+Realignment::Realignment(const Packed_Contig &r, int overhang) :global_ref(r), overhang(overhang) {
+	q_len = r_len = snp_col = 0;
+	matrix_size = overhang * 2 + 5;
+	que.resize(matrix_size); ref.resize(matrix_size); alt.resize(matrix_size);
+	words = 1;
+	peq.resize(ALPHABET_SIZE * ((matrix_size + 63) / 64));
 	memset(ALPHA_TABLE, 4, 256 * sizeof(uint8_t));
 	ALPHA_TABLE['A'] = ALPHA_TABLE['a'] = 0;
 	ALPHA_TABLE['C'] = ALPHA_TABLE['c'] = 1;
 	ALPHA_TABLE['G'] = ALPHA_TABLE['g'] = 2;
 	ALPHA_TABLE['T'] = ALPHA_TABLE['t'] = 3;
+	for (int i = 0; i < 16; i++) NT16_TABLE[i] = ALPHA_TABLE[(uint8_t)seq_nt16_str[i]];
+	read_len = 0;
 }
 
-std::pair<int, int> Realignment::bit_vector_dp(const bam1_t *aln, int q_snp, int r_snp, char alt_allele) {
-	// Extracted query sequence
+void Realignment::load_read(const bam1_t *aln) {
 	const uint8_t *enc_seq = bam_get_seq(aln);
-	int que_l = std::max(q_snp - OVERHANG_LEN, 0); // Query interval [que_l, que_r)
-	int que_r = std::min(q_snp + OVERHANG_LEN + 1, aln->core.l_qseq);
-	q_len = que_r - que_l; // Rows of DP matrix
-	for (int i = que_l; i < que_r; i++) {
-		que[i-que_l+1] = ALPHA_TABLE[seq_nt16_str[bam_seqi(enc_seq, i)]];
+	read_len = aln->core.l_qseq;
+	read_words = read_len / 64 + 2; // One spare word for the shifted extraction in extract()
+	read_code.resize(read_len);
+	read_bits.assign(ALPHABET_SIZE * read_words, 0ull);
+	for (int i = 0; i < read_len; i++) {
+		uint8_t c = NT16_TABLE[bam_seqi(enc_seq, i)];
+		read_code[i] = c;
+		read_bits[c * read_words + i / 64] |= 1ull << (i % 64);
 	}
+}
 
-	// Extracted reference sequence
-	int ref_l = std::max(r_snp - OVERHANG_LEN, 0);
-	int ref_r = std::min(r_snp + OVERHANG_LEN + 1, gr_len);
-	r_len = ref_r - ref_l; // Columns of DP matrix
-	for (int i = ref_l; i < ref_r; i++) {
-		alt[i-ref_l+1] = ref[i-ref_l+1] = ALPHA_TABLE[global_ref[i]];
-	}
-	alt[r_snp-ref_l+1] = ALPHA_TABLE[alt_allele];
+void Realignment::extract(int q_snp, int r_snp, char alt_allele) {
+	// Extracted query sequence, taken from the decoded read
+	int que_l = std::max(q_snp - overhang, 0); // Query interval [que_l, que_r)
+	int que_r = std::min(q_snp + overhang + 1, read_len);
+	q_len = que_r - que_l; // Rows of DP matrix
+	std::copy(read_code.begin() + que_l, read_code.begin() + que_r, que.begin() + 1);
 
-	// Compute Peq[σ]
+	// Extracted reference sequence, clipped to the loaded part of the contig
+	int ref_l = std::max(r_snp - overhang, global_ref.offset);
+	int ref_r = std::min(r_snp + overhang + 1, global_ref.end());
+	r_len = ref_r - ref_l; // Columns of DP matrix
+	global_ref.decode(ref_l - global_ref.offset, r_len, &ref[1]);
+	std::copy(ref.begin() + 1, ref.begin() + r_len + 1, alt.begin() + 1);
+	snp_col = r_snp - ref_l + 1;
+	alt[snp_col] = ALPHA_TABLE[alt_allele];
+
+	// Compute Peq[σ], row i of the query is bit (i-1) % 64 of word (i-1) / 64.
+	// Shift the window out of the read bitmaps, a couple of word operations per code.
+	words = std::max(1, (q_len + 63) / 64);
 	for (int a = 0; a < ALPHABET_SIZE; a++) {
-		peq[a] = 0u;
-		for (int i = q_len; i >= 1; i--) {
-			uint32_t bit = (a == que[i]) ?1u :0u;
-			peq[a] <<= 1u;
-			peq[a]  |= bit;
+		const uint64_t *bits = read_bits.data() + a * read_words;
+		for (int w = 0; w < words; w++) {
+			int b = que_l + w * 64, k = b / 64, off = b % 64;
+			uint64_t v = bits[k] >> off;
+			if (off > 0) v |= bits[k+1] << (64 - off);
+			int valid = q_len - w * 64;
+			if (valid < 64) v &= valid > 0 ?(1ull << valid) - 1 :0ull;
+			peq[a * words + w] = v;
 		}
 	}
+	if (q_len <= 32) {
+		for (int a = 0; a < ALPHABET_SIZE; a++) peq32[a] = (uint32_t)peq[a * words];
+	}
+}
 
-	uint32_t pv = ~0u, mv = 0u; // The first column vertical
-	int ref_score = q_len; // Initial score
-	const uint32_t HIGH_SET = (1u << (q_len-1));
-	for (int j = 1; j <= r_len; j++) { // DP loop
-		uint32_t eq = peq[ref[j]];
-		uint32_t xv = eq | mv;
-		uint32_t xh = (((eq & pv) + pv) ^ pv) | eq;
-
-		uint32_t ph = mv | (~ (xh | pv));
-		uint32_t mh = pv & xh;
+std::pair<int, int> Realignment::solve() const {
+	if (q_len <= 32) return bit_vector_fork<uint32_t>(peq32, q_len, ref.data(), alt.data(), r_len, snp_col);
+	if (q_len <= 64) return bit_vector_fork<uint64_t>(peq.data(), q_len, ref.data(), alt.data(), r_len, snp_col);
+	return bit_vector_fork_blocked(peq.data(), words, q_len, ref.data(), alt.data(), r_len, snp_col);
+}
 
-		if ((ph & HIGH_SET) != 0) ++ref_score;
-		else if ((mh & HIGH_SET) != 0) --ref_score;
+std::pair<int, int> Realignment::bit_vector_dp(const bam1_t *aln, int q_snp, int r_snp, char alt_allele) {
+	load_read(aln);
+	extract(q_snp, r_snp, alt_allele);
+	auto ret = solve(); // Calculate for alternative sequence from the SNP column on
+//	auto truth = edit_distance();
+//	assert(ret == truth);
+	return ret;
+}
 
-		ph = (ph << 1u) | 1u; // This is different from Myers' paper; our first row is 1,2,3...
-		mh <<= 1u;
-		pv = mh | (~(xv | ph));
-		mv = ph & xv;
+void Realignment::add_site(int q_snp, int r_snp, char alt_allele) {
+	extract(q_snp, r_snp, alt_allele);
+	sites.emplace_back();
+	auto &site = sites.back();
+	site.q_len = q_len; site.r_len = r_len; site.snp_col = snp_col;
+	site.solved = q_len > 32;
+	if (site.solved) {
+		site.dist = solve();
+		return;
 	}
+	std::copy(peq32, peq32 + ALPHABET_SIZE, site.peq);
+	site.text = site_text.size();
+	site_text.insert(site_text.end(), ref.begin(), ref.begin() + r_len + 1); // Keep the unused index 0
+	site_text.insert(site_text.end(), alt.begin(), alt.begin() + r_len + 1);
+}
 
-	pv = ~0u; mv = 0u; // Calculate for alternative sequence
-	int alt_score = q_len;
-	for (int j = 1; j <= r_len; j++) {
-		uint32_t eq = peq[alt[j]];
-		uint32_t xv = eq | mv;
-		uint32_t xh = (((eq & pv) + pv) ^ pv) | eq;
-
-		uint32_t ph = mv | (~ (xh | pv));
-		uint32_t mh = pv & xh;
-
-		if ((ph & HIGH_SET) != 0) ++alt_score;
-		else if ((mh & HIGH_SET) != 0) --alt_score;
+void Realignment::realign_batch(std::vector<std::pair<int, int>> &dist) {
+	dist.resize(sites.size());
+	std::vector<int> todo; // Sites of up to 32 bases, the only ones fitting into SIMD lanes
+	for (int i = 0; i < sites.size(); i++) {
+		if (sites[i].solved) dist[i] = sites[i].dist;
+		else todo.push_back(i);
+	}
 
-		ph = (ph << 1u) | 1u;
-		mh <<= 1u;
-		pv = mh | (~(xv | ph));
-		mv = ph & xv;
+	// Fill whole vectors with REF and ALT of each site, so that a site never straddles two vectors
+	const BV_Kernel kernel = bit_vector_kernel();
+	const int site_per_vec = bit_vector_lanes(kernel) / 2;
+	const int vec_n = site_per_vec > 0 ?(int)todo.size() / site_per_vec * site_per_vec :0;
+	tasks.resize(vec_n * 2);
+	for (int i = 0; i < vec_n; i++) {
+		const auto &site = sites[todo[i]];
+		for (int k = 0; k < 2; k++) {
+			auto &task = tasks[i*2+k];
+			std::copy(site.peq, site.peq + ALPHABET_SIZE, task.peq);
+			task.q_len = site.q_len; task.t_len = site.r_len;
+			task.text = site_text.data() + site.text + k * (site.r_len + 1);
+		}
 	}
-//	auto truth = edit_distance();
-//	assert(ref_score == truth.first and alt_score == truth.second);
-	return std::make_pair(ref_score, alt_score);
+	scores.resize(tasks.size());
+	bit_vector_batch(tasks.data(), tasks.size(), scores.data(), kernel);
+	for (int i = 0; i < vec_n; i++) dist[todo[i]] = std::make_pair(scores[i*2], scores[i*2+1]);
+
+	// Leftover sites on the fused scalar path
+	for (int i = vec_n; i < todo.size(); i++) {
+		const auto &site = sites[todo[i]];
+		const uint8_t *text = site_text.data() + site.text;
+		dist[todo[i]] = bit_vector_fork<uint32_t>(site.peq, site.q_len, text, text + site.r_len + 1,
+		                                          site.r_len, site.snp_col);
+	}
+	sites.clear();
+	site_text.clear();
 }
 
 std::pair<int, int> Realignment::edit_distance() {
 	// Initialized DP matrix
-	int H[MATRIX_SIZE][MATRIX_SIZE];
+	std::vector<std::vector<int>> H(q_len + 1, std::vector<int>(r_len + 1));
 	for (int j = 1; j <= r_len; j++) H[0][j] = j; // Fill the first row
 	for (int i = 1; i <= q_len; i++) H[i][0] = i; // Fill the first column
 	H[0][0] = 0;
@@ -115,7 +165,7 @@ std::pair<int, int> Realignment::edit_distance() {
 }
 
 std::pair<int, char> Realignment::detect_allele(int ql, const char *q, int tl, const char *t, int r_snp) {
-	int H[MATRIX_SIZE][MATRIX_SIZE];
+	std::vector<std::vector<int>> H(ql + 1, std::vector<int>(tl + 1));
 	for (int j = 1; j <= tl; j++) H[0][j] = j;
 	for (int i = 1; i <= ql; i++) H[i][0] = i;
 	H[0][0] = 0;
@@ -151,7 +201,7 @@ std::pair<int, char> Realignment::detect_allele(int ql, const char *q, int tl, c
 	std::reverse(u.begin(), u.end());
 	std::reverse(d.begin(), d.end());
 
-	int ref_l = std::max(r_snp - OVERHANG_LEN, 0);
+	int ref_l = std::max(r_snp - overhang, 0);
 	int cnt = 0; char support_allele = '*';
 	for (int i = 0; i < u.length(); i++) {
 		if (u[i] == '-') continue;
@@ -176,7 +226,7 @@ std::pair<int, int> Realignment::affine_gap() {
 	const int GAP_OPEN         = 4;
 	const int GAP_EXTEND       = 2;
 
-	int H[MATRIX_SIZE][MATRIX_SIZE], F[MATRIX_SIZE][MATRIX_SIZE], E[MATRIX_SIZE][MATRIX_SIZE];
+	std::vector<std::vector<int>> H(q_len + 1, std::vector<int>(r_len + 1)), F = H, E = H;
 
 	const int INF = 100000000;
 	for (int j = 0; j <= r_len; j++) H[0][j] = E[0][j] = F[0][j] = -INF;
@@ -255,7 +305,7 @@ void Realignment::show_alignment(const bam1_t *aln, const char *r, int r_snp) co
 	for (int i = center-1; i >= 0; i--) {
 		if (u[i] == '-') continue;
 		cnt++;
-		if (cnt == OVERHANG_LEN) {
+		if (cnt == overhang) {
 			intv_l = i;
 			break;
 		}
@@ -264,7 +314,7 @@ void Realignment::show_alignment(const bam1_t *aln, const char *r, int r_snp) co
 	for (int i = center+1; i < u.length(); i++) {
 		if (u[i] == '-') continue;
 		cnt++;
-		if (cnt == OVERHANG_LEN) {
+		if (cnt == overhang) {
 			intv_r = i + 1;
 			break;
 		}